@@ -139,6 +139,53 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
   block->write_cnt++;
 }
 
+/* Reads CNT consecutive sectors from BLOCK, starting at SECTOR,
+   the Ith of them into BUFFERS[I], each of which must have room
+   for BLOCK_SECTOR_SIZE bytes.  Like block_write_run(), drivers
+   that support it transfer the whole run with a single command. */
+void
+block_read_run (struct block *block, block_sector_t sector, size_t cnt,
+                void *buffers[])
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  if (block->ops->read_run != NULL)
+    block->ops->read_run (block->aux, sector, cnt, buffers);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->read (block->aux, sector + i, buffers[i]);
+  block->read_cnt += cnt;
+}
+
+/* Writes CNT consecutive sectors to BLOCK, starting at SECTOR,
+   the Ith of them from BUFFERS[I], each of which must contain
+   BLOCK_SECTOR_SIZE bytes.  Drivers that support it transfer the
+   whole run with a single command, which saves a seek and a
+   command round trip per sector over calling block_write() in a
+   loop.  Returns after the device has acknowledged every sector. */
+void
+block_write_run (struct block *block, block_sector_t sector, size_t cnt,
+                 const void *buffers[])
+{
+  size_t i;
+
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  if (block->ops->write_run != NULL)
+    block->ops->write_run (block->aux, sector, cnt, buffers);
+  else
+    for (i = 0; i < cnt; i++)
+      block->ops->write (block->aux, sector + i, buffers[i]);
+  block->write_cnt += cnt;
+}
+
 /* Returns the number of sectors in BLOCK. */
 block_sector_t
 block_size (struct block *block)
@@ -53,6 +53,10 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_run (struct block *, block_sector_t, size_t cnt,
+                     void *buffers[]);
+void block_write_run (struct block *, block_sector_t, size_t cnt,
+                      const void *buffers[]);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
@@ -65,6 +69,18 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional.  Reads CNT consecutive sectors, the Ith into
+       BUFFERS[I].  If null, block_read_run() reads one sector at
+       a time. */
+    void (*read_run) (void *aux, block_sector_t, size_t cnt,
+                      void *buffers[]);
+
+    /* Optional.  Writes CNT consecutive sectors, the Ith from
+       BUFFERS[I].  If null, block_write_run() writes one sector
+       at a time. */
+    void (*write_run) (void *aux, block_sector_t, size_t cnt,
+                       const void *buffers[]);
   };
 
 struct block *block_register (const char *name, enum block_type,
@@ -50,6 +50,9 @@
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
 
+/* Most sectors a single READ or WRITE SECTOR command can carry. */
+#define MAX_RUN_SECTORS 256
+
 /* An ATA device. */
 struct ata_disk
   {
@@ -85,7 +88,7 @@ static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -347,7 +350,7 @@ ide_read (void *d_, block_sector_t sec_no, void *buffer)
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_READ_SECTOR_RETRY);
   sema_down (&c->completion_wait);
   if (!wait_while_busy (d))
@@ -367,7 +370,7 @@ ide_write (void *d_, block_sector_t sec_no, const void *buffer)
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
+  select_sector (d, sec_no, 1);
   issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
   if (!wait_while_busy (d))
     PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
@@ -376,24 +379,92 @@ ide_write (void *d_, block_sector_t sec_no, const void *buffer)
   lock_release (&c->lock);
 }
 
+/* Reads CNT consecutive sectors from disk D, starting at SEC_NO,
+   into BUFFERS.  Each READ SECTOR command carries up to
+   MAX_RUN_SECTORS sectors; the disk interrupts once per sector,
+   as soon as that sector is ready to be taken. */
+static void
+ide_read_run (void *d_, block_sector_t sec_no, size_t cnt, void *buffers[])
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  lock_acquire (&c->lock);
+  while (cnt > 0)
+    {
+      size_t run = cnt < MAX_RUN_SECTORS ? cnt : MAX_RUN_SECTORS;
+      size_t i;
+
+      select_sector (d, sec_no, run);
+      issue_pio_command (c, CMD_READ_SECTOR_RETRY);
+      for (i = 0; i < run; i++)
+        {
+          sema_down (&c->completion_wait);
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk read failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          input_sector (c, buffers[i]);
+        }
+      sec_no += run;
+      buffers += run;
+      cnt -= run;
+    }
+  lock_release (&c->lock);
+}
+
+/* Writes CNT consecutive sectors to disk D, starting at SEC_NO,
+   from BUFFERS.  Each WRITE SECTOR command carries up to
+   MAX_RUN_SECTORS sectors; the disk interrupts once per sector
+   and is ready for the next as soon as it has taken the last. */
+static void
+ide_write_run (void *d_, block_sector_t sec_no, size_t cnt,
+               const void *buffers[])
+{
+  struct ata_disk *d = d_;
+  struct channel *c = d->channel;
+  lock_acquire (&c->lock);
+  while (cnt > 0)
+    {
+      size_t run = cnt < MAX_RUN_SECTORS ? cnt : MAX_RUN_SECTORS;
+      size_t i;
+
+      select_sector (d, sec_no, run);
+      issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
+      for (i = 0; i < run; i++)
+        {
+          if (!wait_while_busy (d))
+            PANIC ("%s: disk write failed, sector=%"PRDSNu,
+                   d->name, sec_no + i);
+          output_sector (c, buffers[i]);
+          sema_down (&c->completion_wait);
+        }
+      sec_no += run;
+      buffers += run;
+      cnt -= run;
+    }
+  lock_release (&c->lock);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_run,
+    ide_write_run
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the count CNT to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
   ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_RUN_SECTORS);
 
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt);           /* 256 is written as 0. */
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
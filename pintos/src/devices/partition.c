@@ -317,8 +317,30 @@ partition_write (void *p_, block_sector_t sector, const void *buffer)
   block_write (p->block, p->start + sector, buffer);
 }
 
+/* Reads CNT consecutive sectors from partition P, starting at
+   SECTOR, into BUFFERS. */
+static void
+partition_read_run (void *p_, block_sector_t sector, size_t cnt,
+                    void *buffers[])
+{
+  struct partition *p = p_;
+  block_read_run (p->block, p->start + sector, cnt, buffers);
+}
+
+/* Writes CNT consecutive sectors to partition P, starting at
+   SECTOR, from BUFFERS. */
+static void
+partition_write_run (void *p_, block_sector_t sector, size_t cnt,
+                     const void *buffers[])
+{
+  struct partition *p = p_;
+  block_write_run (p->block, p->start + sector, cnt, buffers);
+}
+
 static struct block_operations partition_operations =
   {
     partition_read,
-    partition_write
+    partition_write,
+    partition_read_run,
+    partition_write_run
   };
@@ -11,6 +11,7 @@
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "filesys/bufcache.h"
 #include "filesys/filesys.h"
 #endif
 
@@ -132,6 +133,7 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+  bufcache_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
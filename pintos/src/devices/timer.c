@@ -24,6 +24,19 @@ static int64_t ticks;
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* A thread waiting in timer_sema_down(). */
+struct timeout
+  {
+    struct list_elem elem;      /* Element in timeouts. */
+    int64_t wake;               /* Tick at which to give up. */
+    struct semaphore *sema;     /* Semaphore being waited on. */
+    bool expired;               /* Woken by the timer? */
+  };
+
+/* Pending timeouts, soonest first.  Shared with the timer
+   interrupt handler, so accessed only with interrupts off. */
+static struct list timeouts;
+
 static intr_handler_func timer_interrupt;
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
@@ -36,6 +49,7 @@ void
 timer_init (void)
 {
   pit_configure_channel (0, 2, TIMER_FREQ);
+  list_init (&timeouts);
   intr_register_ext (0x20, timer_interrupt, "8254 Timer");
 }
 
@@ -96,6 +110,44 @@ timer_sleep (int64_t ticks)
     thread_yield ();
 }
 
+/* Returns true if timeout A expires before timeout B. */
+static bool
+timeout_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct timeout *a = list_entry (a_, struct timeout, elem);
+  const struct timeout *b = list_entry (b_, struct timeout, elem);
+  return a->wake < b->wake;
+}
+
+/* Downs SEMA, giving up after about TICKS timer ticks.  Returns
+   true if SEMA was upped in time, false if the wait timed out.
+   A timeout that races with an up leaves SEMA upped, so the next
+   wait on it may return at once.  Interrupts must be turned on. */
+bool
+timer_sema_down (struct semaphore *sema, int64_t ticks)
+{
+  struct timeout t;
+  enum intr_level old_level;
+
+  ASSERT (intr_get_level () == INTR_ON);
+  t.wake = timer_ticks () + ticks;
+  t.sema = sema;
+  t.expired = false;
+
+  old_level = intr_disable ();
+  list_insert_ordered (&timeouts, &t.elem, timeout_less, NULL);
+  intr_set_level (old_level);
+
+  sema_down (sema);
+
+  old_level = intr_disable ();
+  if (!t.expired)
+    list_remove (&t.elem);
+  intr_set_level (old_level);
+  return !t.expired;
+}
+
 /* Sleeps for approximately MS milliseconds.  Interrupts must be
    turned on. */
 void
@@ -171,6 +223,16 @@ static void
 timer_interrupt (struct intr_frame *args UNUSED)
 {
   ticks++;
+  while (!list_empty (&timeouts))
+    {
+      struct timeout *t = list_entry (list_front (&timeouts),
+                                      struct timeout, elem);
+      if (t->wake > ticks)
+        break;
+      list_pop_front (&timeouts);
+      t->expired = true;
+      sema_up (t->sema);
+    }
   thread_tick ();
 }
 
@@ -1,107 +1,365 @@
 #include "filesys/bufcache.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "devices/timer.h"
 #include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include <hash.h>
 #include <list.h>
+#include <round.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <debug.h>
 #include <string.h>
 
-#define NUM_ENTRIES 64
+#define INVALID_SECTOR ((block_sector_t) -1)
 
-struct data {
-  unsigned char contents[BLOCK_SECTOR_SIZE];
-};
+/* Cache memory comes from the kernel pool a page at a time, each
+   page holding ENTRIES_PER_PAGE file system blocks: fewer, the
+   larger the blocks, up to MAX_ENTRIES_PER_PAGE.  The cache never
+   shrinks below MIN_ENTRIES, whatever the block size: room for all
+   JOURNAL_MAX blocks the journal may hold, which cannot be evicted,
+   and as many again for everything else. */
+#define ENTRIES_PER_PAGE (PGSIZE / FS_BLOCK_SIZE)
+#define MAX_ENTRIES_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+#define MIN_ENTRIES (2 * JOURNAL_MAX)
+#define MIN_PAGES ((size_t) DIV_ROUND_UP (MIN_ENTRIES, ENTRIES_PER_PAGE))
+
+/* 2Q queue sizes: at most a quarter of the entries are held for
+   blocks seen only once, and the sectors last evicted from there are
+   remembered, up to half the number of entries, so that a second
+   reference can be recognized. */
+#define A1IN_MAX (entry_cnt / 4)
+#define A1OUT_MAX (entry_cnt / 2)
+
+/* Longest run of consecutive dirty blocks written back at once.
+   Bounds how long a run keeps its entries busy. */
+#define MAX_RUN 32
 
 struct metadata {
   block_sector_t sector;
-  struct data* entry;
-  struct list_elem lru_elem;
+  unsigned char* contents;        /* FS_BLOCK_SIZE bytes. */
+  struct hash_elem hash_elem;     /* Element in sector_index. */
+  struct list_elem lru_elem;       /* Element in lru_list or a1in_list. */
+  struct lock data_lock;          /* Serializes copies into and out of ENTRY. */
   struct condition until_ready;
+  int pin_cnt;                    /* Number of threads using ENTRY right now. */
   bool ready;
   bool dirty;
+  bool in_a1in;                   /* On a1in_list rather than lru_list? */
+  bool held;                      /* Held by the journal: not to be written back. */
 };
 
-static struct metadata entries[NUM_ENTRIES];
-static struct data cached_data[NUM_ENTRIES];
+/* One page of cache memory and the entries that describe it. */
+struct cache_page {
+  struct list_elem elem;          /* Element in cache_pages. */
+  unsigned char* kpage;           /* ENTRIES_PER_PAGE blocks of data. */
+  struct metadata entries[MAX_ENTRIES_PER_PAGE];
+};
 
+static struct list cache_pages;
+static size_t page_cnt;         /* Number of pages in cache_pages. */
+static size_t target_pages;     /* Size to grow back to when memory allows. */
+static size_t entry_cnt;        /* page_cnt * ENTRIES_PER_PAGE. */
 
+/* Percentage of the kernel pool to use for the cache, from the
+   kernel command line. */
+unsigned bufcache_pct = 5;
+
+/* Protects sector_index, the eviction queues, cache_pages, and the
+   sector, pin_cnt, ready, dirty, in_a1in and held members of every
+   entry.
+   The contents of an entry are protected by its own data_lock
+   instead, so copies to and from different sectors may proceed in
+   parallel. */
 static struct lock cache_lock;
 static struct condition until_one_ready;
+
+/* Held across write_back() and shrink(), both of which drop
+   cache_lock in the middle of walking entries: this keeps shrink()
+   from freeing a page that a write-back is still working through.
+   Acquired before cache_lock. */
+static struct lock writeback_lock;
+
+/* Eviction queues.  Under BUFCACHE_LRU every entry is on lru_list.
+   Under BUFCACHE_2Q, lru_list is the "Am" queue of blocks referenced
+   more than once, kept in LRU order, and a1in_list is a FIFO of
+   blocks referenced once, so a long scan only ever cycles through
+   a1in_list and cannot push the hot blocks in lru_list out. */
 static struct list lru_list;
+static struct list a1in_list;
+static size_t a1in_cnt;
+static block_sector_t *a1out;   /* Ring of sectors evicted from a1in_list. */
+static size_t a1out_size;       /* Capacity of a1out. */
+static size_t a1out_head, a1out_cnt;
 
-void bufcache_init(void) {
-  lock_init(&cache_lock);
-  list_init(&lru_list);
-  cond_init(&until_one_ready);
-  for (int i = 0; i < NUM_ENTRIES; i++) {
-    cond_init(&entries[i].until_ready);
-    entries[i].dirty = false;
-    entries[i].ready = true;
-    entries[i].sector = -1; //INVALID SECTOR
-    entries[i].entry = &cached_data[i];
-    list_push_front(&lru_list, &entries[i].lru_elem);
-  }
+enum bufcache_policy bufcache_policy = BUFCACHE_2Q;
+
+/* Demand hits and misses, by class of block. */
+static unsigned long long hit_cnt[BC_CLASS_CNT];
+static unsigned long long miss_cnt[BC_CLASS_CNT];
+
+/* Every entry whose sector is valid, keyed by sector.  An entry is
+   inserted as soon as it is chosen to hold a sector, before its
+   contents are read, so concurrent accesses wait for it rather than
+   loading the sector twice. */
+static struct hash sector_index;
+
+/* Write-behind tuning.  Set from the kernel command line by
+   threads/init.c before bufcache_init() runs. */
+unsigned bufcache_flush_interval = 1000;
+unsigned bufcache_dirty_high = 50;
+unsigned bufcache_dirty_low = 25;
+
+static int dirty_cnt;           /* Number of dirty entries. */
+static bool flush_requested;    /* Set when dirty_cnt passes the high mark. */
+static struct semaphore flush_wakeup;  /* Upped along with flush_requested. */
+
+static void flusher(void *aux UNUSED);
+
+/* Called by the flusher before each periodic write-back, so that
+   metadata kept elsewhere in memory can be stored into the cache
+   and go to disk in the same sorted pass. */
+static void (*flush_hook)(void);
+
+/* Sectors queued for the read-ahead worker, also protected by
+   cache_lock.  Requests that arrive while the queue is full are
+   dropped; read-ahead is only a hint. */
+#define RA_QUEUE_SIZE 32
+struct readahead {
+  struct block *block;
+  block_sector_t sector;
+};
+static struct readahead ra_queue[RA_QUEUE_SIZE];
+static size_t ra_head;          /* Index of oldest request. */
+static size_t ra_cnt;           /* Number of queued requests. */
+static struct condition until_readahead;
+
+static void readahead_worker(void *aux UNUSED);
+
+static unsigned
+metadata_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct metadata *meta = hash_entry (e, struct metadata, hash_elem);
+  return hash_int (meta->sector);
 }
 
-static struct metadata* get_eviction_candidate(void) {
-  ASSERT(lock_held_by_current_thread(&cache_lock));
+static bool
+metadata_less (const struct hash_elem *a, const struct hash_elem *b,
+               void *aux UNUSED)
+{
+  const struct metadata *meta_a = hash_entry (a, struct metadata, hash_elem);
+  const struct metadata *meta_b = hash_entry (b, struct metadata, hash_elem);
+  return meta_a->sector < meta_b->sector;
+}
+
+/* Returns true if more than PCT percent of the cache is dirty. */
+static bool over_dirty_ratio(unsigned pct) {
+  return (unsigned) dirty_cnt * 100 > pct * entry_cnt;
+}
+
+/* Selects the replacement policy named NAME ("lru" or "2q").
+   Returns false if NAME is not a known policy. */
+bool bufcache_set_policy(const char *name) {
+  if (name == NULL)
+    return false;
+  else if (!strcmp(name, "lru"))
+    bufcache_policy = BUFCACHE_LRU;
+  else if (!strcmp(name, "2q"))
+    bufcache_policy = BUFCACHE_2Q;
+  else
+    return false;
+  return true;
+}
+
+/* Returns the least recently queued entry in QUEUE that may be
+   evicted, or a null pointer if there is none. */
+static struct metadata* oldest_evictable(struct list *queue) {
   struct list_elem* e;
-  for (e = list_rbegin(&lru_list); e != list_rend(&lru_list); e = list_prev(e)) {
+  for (e = list_rbegin(queue); e != list_rend(queue); e = list_prev(e)) {
     struct metadata* meta = list_entry(e, struct metadata, lru_elem);
-    if (meta->ready == true) {
+    if (meta->ready && meta->pin_cnt == 0 && !meta->held) {
       return meta;
     }
   }
   return NULL;
 }
 
-static struct metadata* find(block_sector_t sector) {
-    for (int i = 0; i < NUM_ENTRIES; i++) {
-      if (sector == entries[i].sector) {
-        return &entries[i];
-      }
+static struct metadata* get_eviction_candidate(void) {
+  ASSERT(lock_held_by_current_thread(&cache_lock));
+  struct metadata* meta = NULL;
+
+  /* Unused entries never move from the tail of lru_list. */
+  if (!list_empty(&lru_list)) {
+    meta = list_entry(list_back(&lru_list), struct metadata, lru_elem);
+    if (meta->sector == INVALID_SECTOR && meta->ready && meta->pin_cnt == 0)
+      return meta;
+  }
+
+  if (bufcache_policy == BUFCACHE_2Q && a1in_cnt > A1IN_MAX)
+    meta = oldest_evictable(&a1in_list);
+  else
+    meta = NULL;
+  if (meta == NULL)
+    meta = oldest_evictable(&lru_list);
+  if (meta == NULL)
+    meta = oldest_evictable(&a1in_list);
+  return meta;
+}
+
+/* Removes SECTOR from the 2Q ghost queue, returning true if it was
+   there, that is, if it was evicted from a1in_list recently. */
+static bool a1out_remove(block_sector_t sector) {
+  for (size_t i = 0; i < a1out_cnt; i++) {
+    size_t idx = (a1out_head + i) % a1out_size;
+    if (a1out[idx] == sector) {
+      /* Fill the hole with the oldest ghost and drop the oldest. */
+      a1out[idx] = a1out[a1out_head];
+      a1out_head = (a1out_head + 1) % a1out_size;
+      a1out_cnt--;
+      return true;
     }
-    return NULL;
+  }
+  return false;
 }
-static void clean(struct block *block, struct metadata* entry) {
+
+/* Remembers SECTOR as evicted from a1in_list, forgetting the oldest
+   such sector if the ghost queue is full. */
+static void a1out_add(block_sector_t sector) {
+  while (a1out_cnt > 0 && a1out_cnt >= A1OUT_MAX) {
+    a1out_head = (a1out_head + 1) % a1out_size;
+    a1out_cnt--;
+  }
+  a1out[(a1out_head + a1out_cnt++) % a1out_size] = sector;
+}
+
+/* Removes ENTRY from whichever eviction queue it is on. */
+static void dequeue(struct metadata* entry) {
+  list_remove(&entry->lru_elem);
+  if (entry->in_a1in) {
+    entry->in_a1in = false;
+    a1in_cnt--;
+  }
+}
+
+/* Queues ENTRY, which has just been loaded with a block of class
+   CLS, for eviction.  Under 2Q a block goes to lru_list only if it
+   was referenced recently enough to still be in a1out, or if it is
+   metadata: inode, indirect and directory blocks are nearly always
+   used again, and must survive scans of the data they describe. */
+static void enqueue_new(struct metadata* entry, enum bufcache_class cls) {
+  if (bufcache_policy == BUFCACHE_2Q && cls == BC_DATA
+      && !a1out_remove(entry->sector)) {
+    entry->in_a1in = true;
+    a1in_cnt++;
+    list_push_front(&a1in_list, &entry->lru_elem);
+  } else {
+    list_push_front(&lru_list, &entry->lru_elem);
+  }
+}
+
+static struct metadata* find(block_sector_t sector) {
+  ASSERT(lock_held_by_current_thread(&cache_lock));
+  struct metadata key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find(&sector_index, &key.hash_elem);
+  return e != NULL ? hash_entry(e, struct metadata, hash_elem) : NULL;
+}
+
+/* Writes back the CNT dirty entries in RUN, which hold consecutive
+   sectors in ascending order, with a single device request.  The
+   entries are marked not ready, so nobody can pin them, while
+   cache_lock is dropped for the write. */
+static void clean_run(struct block *block, struct metadata **run, size_t cnt) {
+    const void *buffers[MAX_RUN];
+    size_t i;
+
     ASSERT(lock_held_by_current_thread(&cache_lock));
-    ASSERT(entry->dirty);
-    entry->ready = false;
+    ASSERT(cnt > 0 && cnt <= MAX_RUN);
+    for (i = 0; i < cnt; i++) {
+      ASSERT(run[i]->dirty && !run[i]->held);
+      ASSERT(run[i]->sector == run[0]->sector + i);
+      run[i]->ready = false;
+      buffers[i] = run[i]->contents;
+    }
     lock_release(&cache_lock);
-    block_write(block, entry->sector, (void*) entry->entry);
+    filesys_write_blocks(block, run[0]->sector, cnt, buffers);
     lock_acquire(&cache_lock);
-    entry->ready = true;
-    entry->dirty = false;
-    cond_broadcast(&entry->until_ready, &cache_lock);
+    for (i = 0; i < cnt; i++) {
+      run[i]->ready = true;
+      run[i]->dirty = false;
+      dirty_cnt--;
+      cond_broadcast(&run[i]->until_ready, &cache_lock);
+    }
     cond_broadcast(&until_one_ready, &cache_lock);
 }
 
-static void replace(struct block *block, struct metadata* entry, block_sector_t sector) {
+static void clean(struct block *block, struct metadata* entry) {
+    clean_run(block, &entry, 1);
+}
+
+static void replace(struct block *block, struct metadata* entry, block_sector_t sector,
+                    enum bufcache_class cls) {
   ASSERT(lock_held_by_current_thread(&cache_lock));
   ASSERT(!entry->dirty);
+  ASSERT(entry->pin_cnt == 0);
+  if (entry->sector != INVALID_SECTOR) {
+    hash_delete(&sector_index, &entry->hash_elem);
+    if (entry->in_a1in)
+      a1out_add(entry->sector);
+  }
+  dequeue(entry);
   entry->sector = sector;
+  hash_insert(&sector_index, &entry->hash_elem);
+  enqueue_new(entry, cls);
   entry->ready = false;
   lock_release(&cache_lock);
-  block_read(block, sector, (void*) entry->entry);
+  filesys_read_block(block, sector, entry->contents);
   lock_acquire(&cache_lock);
   entry->ready = true;
   cond_broadcast(&entry->until_ready, &cache_lock);
   cond_broadcast(&until_one_ready, &cache_lock);
 }
 
-static struct metadata* bufcache_access(struct block *block, block_sector_t sector) {
+/* Returns the ready entry holding SECTOR, a block of class CLS,
+   loading it if necessary, with its pin count incremented so that it
+   cannot be evicted until the caller passes it to unpin().  DEMAND
+   is false for read-ahead, which is left out of the statistics. */
+static struct metadata* bufcache_access(struct block *block, block_sector_t sector,
+                                        enum bufcache_class cls, bool demand) {
   ASSERT(lock_held_by_current_thread(&cache_lock));
+  ASSERT(cls < BC_CLASS_CNT);
+  bool first_lookup = true;
   while(1) {
     struct metadata* match = find(sector);
 
+    if (demand && first_lookup) {
+      if (match != NULL)
+        hit_cnt[cls]++;
+      else
+        miss_cnt[cls]++;
+    }
+    first_lookup = false;
+
     if (match != NULL) {
       if (!match->ready) {
         cond_wait(&match->until_ready, &cache_lock);
         continue;
       }
 
-      list_remove(&match->lru_elem);
-      list_push_front(&lru_list, &match->lru_elem);
+      match->pin_cnt++;
+      /* Under 2Q, a hit in a1in_list is not yet evidence of reuse:
+         it usually comes from the same sequential pass. */
+      if (!match->in_a1in) {
+        list_remove(&match->lru_elem);
+        list_push_front(&lru_list, &match->lru_elem);
+      }
 
       return match;
     }
@@ -117,33 +375,500 @@ static struct metadata* bufcache_access(struct block *block, block_sector_t sect
     }
 
     else {
-      replace(block, to_evict, sector);
+      replace(block, to_evict, sector, cls);
+    }
+  }
+}
+
+/* Drops a pin taken by bufcache_access(), marking ENTRY dirty if
+   DIRTY is true. */
+static void unpin(struct metadata* entry, bool dirty) {
+  ASSERT(lock_held_by_current_thread(&cache_lock));
+  ASSERT(entry->pin_cnt > 0);
+  if (dirty && !entry->dirty) {
+    entry->dirty = true;
+    dirty_cnt++;
+    if (!flush_requested && over_dirty_ratio(bufcache_dirty_high)) {
+      flush_requested = true;
+      sema_up(&flush_wakeup);
     }
   }
+  if (--entry->pin_cnt == 0)
+    cond_broadcast(&until_one_ready, &cache_lock);
 }
 
-void bufcache_read(struct block *block, block_sector_t sector, void* buffer, size_t offset, size_t length) {
-  ASSERT(offset + length <= BLOCK_SECTOR_SIZE);
+/* Adds a page of entries to the cache.  Returns false if no page
+   could be allocated.  The new entries go at the tail of lru_list,
+   where they are the first to be used. */
+static bool grow(void) {
+  struct cache_page *page = malloc(sizeof *page);
+  if (page == NULL)
+    return false;
+  page->kpage = palloc_get_page(0);
+  if (page->kpage == NULL) {
+    free(page);
+    return false;
+  }
+
   lock_acquire(&cache_lock);
-  struct metadata* entry = bufcache_access(block, sector);
-  memcpy(buffer, &entry->entry->contents[offset], length);
+  for (int i = 0; i < ENTRIES_PER_PAGE; i++) {
+    struct metadata *meta = &page->entries[i];
+    lock_init(&meta->data_lock);
+    cond_init(&meta->until_ready);
+    meta->pin_cnt = 0;
+    meta->dirty = false;
+    meta->ready = true;
+    meta->in_a1in = false;
+    meta->held = false;
+    meta->sector = INVALID_SECTOR;
+    meta->contents = page->kpage + i * FS_BLOCK_SIZE;
+    list_push_back(&lru_list, &meta->lru_elem);
+  }
+  list_push_back(&cache_pages, &page->elem);
+  page_cnt++;
+  entry_cnt += ENTRIES_PER_PAGE;
+  cond_broadcast(&until_one_ready, &cache_lock);
   lock_release(&cache_lock);
+  return true;
 }
 
-void bufcache_write(struct block *block, block_sector_t sector, void* buffer, size_t offset, size_t length) {
-  ASSERT(offset + length <= BLOCK_SECTOR_SIZE);
+/* Gives a page of entries back to the kernel pool, writing back any
+   dirty entries in it first.  Only a page none of whose entries is
+   in use can be released.  Returns false if there was no such page
+   or the cache is already at MIN_PAGES. */
+static bool shrink(void) {
+  struct cache_page *page = NULL;
+  struct list_elem *e;
+
+  lock_acquire(&writeback_lock);
   lock_acquire(&cache_lock);
-  struct metadata* entry = bufcache_access(block, sector);
-  memcpy(&entry->entry->contents[offset], buffer, length);
-  entry->dirty = true;
+ retry:
+  if (page_cnt <= MIN_PAGES) {
+    lock_release(&cache_lock);
+    lock_release(&writeback_lock);
+    return false;
+  }
+  for (e = list_rbegin(&cache_pages); e != list_rend(&cache_pages); e = list_prev(e)) {
+    page = list_entry(e, struct cache_page, elem);
+    int i;
+    for (i = 0; i < ENTRIES_PER_PAGE; i++) {
+      if (!page->entries[i].ready || page->entries[i].pin_cnt > 0
+          || page->entries[i].held)
+        break;
+    }
+    if (i == ENTRIES_PER_PAGE)
+      break;
+  }
+  if (e == list_rend(&cache_pages)) {
+    lock_release(&cache_lock);
+    lock_release(&writeback_lock);
+    return false;
+  }
+
+  /* clean() drops cache_lock, so start over after each write. */
+  for (int i = 0; i < ENTRIES_PER_PAGE; i++) {
+    if (page->entries[i].dirty) {
+      clean(fs_device, &page->entries[i]);
+      goto retry;
+    }
+  }
+
+  for (int i = 0; i < ENTRIES_PER_PAGE; i++) {
+    struct metadata *meta = &page->entries[i];
+    if (meta->sector != INVALID_SECTOR)
+      hash_delete(&sector_index, &meta->hash_elem);
+    dequeue(meta);
+  }
+  list_remove(&page->elem);
+  page_cnt--;
+  entry_cnt -= ENTRIES_PER_PAGE;
+  while (a1out_cnt > A1OUT_MAX) {
+    a1out_head = (a1out_head + 1) % a1out_size;
+    a1out_cnt--;
+  }
   lock_release(&cache_lock);
+  lock_release(&writeback_lock);
+
+  palloc_free_page(page->kpage);
+  free(page);
+  return true;
+}
+
+/* Grows or shrinks the cache by a page according to how much of the
+   kernel pool is free: below 1/16 of the pool, the cache gives a page
+   back; above 1/8, it grows back toward its configured size. */
+static void resize(void) {
+  size_t pool_pages = palloc_page_cnt(0);
+  size_t free_pages = palloc_free_cnt(0);
+
+  if (free_pages < pool_pages / 16)
+    shrink();
+  else if (free_pages > pool_pages / 8 && page_cnt < target_pages)
+    grow();
+}
+
+void bufcache_init(void) {
+  lock_init(&cache_lock);
+  lock_init(&writeback_lock);
+  list_init(&lru_list);
+  list_init(&a1in_list);
+  list_init(&cache_pages);
+  a1in_cnt = a1out_head = a1out_cnt = 0;
+  page_cnt = entry_cnt = 0;
+  cond_init(&until_one_ready);
+  if (!hash_init(&sector_index, metadata_hash, metadata_less, NULL))
+    PANIC("buffer cache index creation failed");
+
+  target_pages = palloc_page_cnt(0) * bufcache_pct / 100;
+  if (target_pages < MIN_PAGES)
+    target_pages = MIN_PAGES;
+  a1out_size = target_pages * ENTRIES_PER_PAGE / 2;
+  a1out = malloc(a1out_size * sizeof *a1out);
+  if (a1out == NULL)
+    PANIC("buffer cache allocation failed");
+  while (page_cnt < target_pages && grow())
+    continue;
+  if (page_cnt < MIN_PAGES)
+    PANIC("buffer cache allocation failed");
+
+  dirty_cnt = 0;
+  flush_requested = false;
+  sema_init(&flush_wakeup, 0);
+  thread_create("bufcache-flush", PRI_DEFAULT, flusher, NULL);
+
+  ra_head = ra_cnt = 0;
+  cond_init(&until_readahead);
+  thread_create("bufcache-ra", PRI_DEFAULT, readahead_worker, NULL);
+}
+
+void bufcache_read(struct block *block, block_sector_t sector, void* buffer, size_t offset, size_t length,
+                   enum bufcache_class cls) {
+  ASSERT(offset + length <= (size_t) FS_BLOCK_SIZE);
+  lock_acquire(&cache_lock);
+  struct metadata* entry = bufcache_access(block, sector, cls, true);
+  lock_release(&cache_lock);
+
+  lock_acquire(&entry->data_lock);
+  memcpy(buffer, &entry->contents[offset], length);
+  lock_release(&entry->data_lock);
+
+  lock_acquire(&cache_lock);
+  unpin(entry, false);
+  lock_release(&cache_lock);
+}
+
+void bufcache_write(struct block *block, block_sector_t sector, void* buffer, size_t offset, size_t length,
+                    enum bufcache_class cls) {
+  ASSERT(offset + length <= (size_t) FS_BLOCK_SIZE);
+  lock_acquire(&cache_lock);
+  struct metadata* entry = bufcache_access(block, sector, cls, true);
+  lock_release(&cache_lock);
+
+  lock_acquire(&entry->data_lock);
+  memcpy(&entry->contents[offset], buffer, length);
+  lock_release(&entry->data_lock);
+
+  lock_acquire(&cache_lock);
+  unpin(entry, true);
+  lock_release(&cache_lock);
+}
+
+/* Returns a pointer to the cached contents of SECTOR, a block of
+   class CLS, so that the caller can read or modify it in place.  The
+   entry stays pinned, and locked against every other user, until the
+   caller passes SECTOR to bufcache_put().  A thread must not get the
+   same sector twice, and should get nested blocks in a consistent
+   order (for example, an indirect block before the blocks it points
+   to) to avoid deadlock. */
+void* bufcache_get(struct block *block, block_sector_t sector, enum bufcache_class cls) {
+  lock_acquire(&cache_lock);
+  struct metadata* entry = bufcache_access(block, sector, cls, true);
+  lock_release(&cache_lock);
+
+  lock_acquire(&entry->data_lock);
+  return entry->contents;
+}
+
+/* Releases SECTOR, obtained with bufcache_get(), marking it dirty if
+   the caller modified it. */
+void bufcache_put(struct block *block UNUSED, block_sector_t sector, bool dirty) {
+  lock_acquire(&cache_lock);
+  struct metadata* entry = find(sector);
+  ASSERT(entry != NULL);
+  ASSERT(lock_held_by_current_thread(&entry->data_lock));
+  lock_release(&entry->data_lock);
+  unpin(entry, dirty);
+  lock_release(&cache_lock);
+}
+
+/* Loads SECTOR, a block of class CLS, into the cache if it is not
+   there already, and keeps it there, never writing it back, until
+   bufcache_release().  The journal holds each sector it logs from
+   before the sector changes until the change is committed, so that
+   the change cannot reach its home on disk before the log does. */
+void bufcache_hold(struct block *block, block_sector_t sector, enum bufcache_class cls) {
+  lock_acquire(&cache_lock);
+  struct metadata* entry = bufcache_access(block, sector, cls, false);
+  entry->held = true;
+  unpin(entry, false);
+  lock_release(&cache_lock);
+}
+
+/* Returns how many sectors may be held by bufcache_hold() at once:
+   half of the cache, so that the rest can still be evicted. */
+size_t bufcache_hold_max(void) {
+  lock_acquire(&cache_lock);
+  size_t max = entry_cnt / 2;
+  lock_release(&cache_lock);
+  return max;
+}
+
+/* Lets SECTOR, held by bufcache_hold(), be written back and evicted
+   again. */
+void bufcache_release(struct block *block UNUSED, block_sector_t sector) {
+  lock_acquire(&cache_lock);
+  struct metadata* entry = find(sector);
+  ASSERT(entry != NULL && entry->held);
+  entry->held = false;
+  cond_broadcast(&until_one_ready, &cache_lock);
+  lock_release(&cache_lock);
+}
+
+/* Drops any cached copy of the CNT sectors starting at SECTOR,
+   dirty or not, after waiting out reads and writes of it in flight.
+   For callers that write those sectors on disk directly, and so make
+   every cached copy stale.  None of them may be held by the
+   journal: only file data is written directly, and the free map
+   does not hand out a released sector again until the journal has
+   committed, and so let go of, its old contents. */
+void bufcache_discard(struct block *block UNUSED, block_sector_t sector, size_t cnt) {
+  lock_acquire(&cache_lock);
+  for (size_t i = 0; i < cnt; i++) {
+    struct metadata* entry;
+    while ((entry = find(sector + i)) != NULL && (!entry->ready || entry->pin_cnt > 0)) {
+      if (!entry->ready)
+        cond_wait(&entry->until_ready, &cache_lock);
+      else
+        cond_wait(&until_one_ready, &cache_lock);
+    }
+    if (entry != NULL) {
+      ASSERT(!entry->held);
+      hash_delete(&sector_index, &entry->hash_elem);
+      dequeue(entry);
+      entry->sector = INVALID_SECTOR;
+      if (entry->dirty) {
+        entry->dirty = false;
+        dirty_cnt--;
+      }
+      list_push_back(&lru_list, &entry->lru_elem);
+    }
+  }
+  lock_release(&cache_lock);
+}
+
+/* Asks the read-ahead worker to bring SECTOR into the cache without
+   waiting for it.  Does nothing if SECTOR is already cached or the
+   request queue is full. */
+void bufcache_readahead(struct block *block, block_sector_t sector) {
+  lock_acquire(&cache_lock);
+  if (ra_cnt < RA_QUEUE_SIZE && find(sector) == NULL) {
+    struct readahead *ra = &ra_queue[(ra_head + ra_cnt++) % RA_QUEUE_SIZE];
+    ra->block = block;
+    ra->sector = sector;
+    cond_signal(&until_readahead, &cache_lock);
+  }
+  lock_release(&cache_lock);
+}
+
+/* Loads queued read-ahead sectors into the cache in the background,
+   so that a later bufcache_read() of them either hits or waits for a
+   read already in progress. */
+static void readahead_worker(void *aux UNUSED) {
+  lock_acquire(&cache_lock);
+  for (;;) {
+    while (ra_cnt == 0)
+      cond_wait(&until_readahead, &cache_lock);
+
+    struct readahead ra = ra_queue[ra_head];
+    ra_head = (ra_head + 1) % RA_QUEUE_SIZE;
+    ra_cnt--;
+
+    if (find(ra.sector) == NULL)
+      unpin(bufcache_access(ra.block, ra.sector, BC_DATA, false), false);
+  }
+}
+
+static int compare_sectors(const void *a_, const void *b_) {
+  struct metadata *const *a = a_;
+  struct metadata *const *b = b_;
+  if ((*a)->sector < (*b)->sector)
+    return -1;
+  return (*a)->sector > (*b)->sector;
+}
+
+/* True if ENTRY is dirty and idle, so write_back() may clean it. */
+static bool cleanable(const struct metadata *entry) {
+  return entry->dirty && entry->ready && entry->pin_cnt == 0 && !entry->held;
+}
+
+/* Writes dirty entries back in ascending sector order until no more
+   than LIMIT_PCT percent of the cache is dirty.  Runs of consecutive
+   sectors go to the disk as one request of up to MAX_RUN sectors.
+   Entries that are in use are skipped; they will be picked up by a
+   later pass. */
+static void write_back(unsigned limit_pct) {
+  struct metadata **dirty;
+  struct list_elem *e;
+  size_t cnt = 0;
+
+  lock_acquire(&writeback_lock);
+  lock_acquire(&cache_lock);
+  dirty = malloc(entry_cnt * sizeof *dirty);
+  if (dirty == NULL) {
+    lock_release(&cache_lock);
+    lock_release(&writeback_lock);
+    return;
+  }
+  for (e = list_begin(&cache_pages); e != list_end(&cache_pages); e = list_next(e)) {
+    struct cache_page *page = list_entry(e, struct cache_page, elem);
+    for (int i = 0; i < ENTRIES_PER_PAGE; i++) {
+      if (page->entries[i].dirty)
+        dirty[cnt++] = &page->entries[i];
+    }
+  }
+  qsort(dirty, cnt, sizeof *dirty, compare_sectors);
+
+  /* Sectors may have changed hands while cache_lock was dropped for
+     an earlier run, so contiguity is checked against live state. */
+  size_t i = 0;
+  while (i < cnt && over_dirty_ratio(limit_pct)) {
+    size_t n = 0;
+    while (i + n < cnt && n < MAX_RUN && cleanable(dirty[i + n])
+           && dirty[i + n]->sector == dirty[i]->sector + n)
+      n++;
+    if (n > 0)
+      clean_run(fs_device, dirty + i, n);
+    i += n > 0 ? n : 1;
+  }
+  lock_release(&cache_lock);
+  lock_release(&writeback_lock);
+  free(dirty);
+}
+
+/* Background write-behind thread.  Wakes every
+   bufcache_flush_interval milliseconds to write back everything that
+   is dirty, or sooner if the dirty ratio passes bufcache_dirty_high,
+   in which case it writes back down to bufcache_dirty_low.  Each time
+   it wakes it also adjusts the cache size to the memory available.
+   With periodic flushing disabled it still wakes once a second to
+   resize.  In between it stays blocked on flush_wakeup. */
+static void flusher(void *aux UNUSED) {
+  unsigned interval_ms = bufcache_flush_interval > 0 ? bufcache_flush_interval : 1000;
+  int64_t interval = (int64_t) interval_ms * TIMER_FREQ / 1000;
+  for (;;) {
+    int64_t start = timer_ticks();
+    while (timer_elapsed(start) < interval && !flush_requested)
+      timer_sema_down(&flush_wakeup, interval - timer_elapsed(start));
+
+    if (flush_requested) {
+      flush_requested = false;
+      write_back(bufcache_dirty_low);
+    } else if (bufcache_flush_interval > 0) {
+      if (flush_hook != NULL)
+        flush_hook();
+      else
+        write_back(0);
+    }
+    resize();
+  }
+}
+
+/* Makes HOOK do each periodic write-back in place of the cache, so
+   that the file system can order it around its journal.  HOOK is
+   expected to call bufcache_flush() itself. */
+void bufcache_on_flush(void (*hook)(void)) {
+  flush_hook = hook;
+}
+
+static int compare_sector_numbers(const void *a_, const void *b_) {
+  const block_sector_t *a = a_;
+  const block_sector_t *b = b_;
+  if (*a < *b)
+    return -1;
+  return *a > *b;
+}
+
+/* Writes the CNT SECTORS of BLOCK to disk, if they are cached and
+   dirty, and returns once they are durable.  Consecutive sectors are
+   coalesced as in write_back().  Sorts SECTORS in place.  Dirty
+   entries that are pinned are waited for, since they may hold data
+   the caller wrote; writes in flight are waited out likewise.
+   Sectors held by the journal are skipped: they reach the disk
+   through it. */
+void bufcache_flush_sectors(struct block *block, block_sector_t *sectors, size_t cnt) {
+  struct metadata *run[MAX_RUN];
+  size_t run_cnt = 0;
+  size_t i = 0;
+
+  qsort(sectors, cnt, sizeof *sectors, compare_sector_numbers);
+  lock_acquire(&writeback_lock);
+  lock_acquire(&cache_lock);
+  while (i < cnt) {
+    struct metadata *entry = find(sectors[i]);
+    if (entry != NULL && entry->held) {
+      i++;
+      continue;
+    }
+    bool busy = entry != NULL && (!entry->ready || (entry->dirty && entry->pin_cnt > 0));
+    bool extends = entry != NULL && run_cnt < MAX_RUN
+                   && (run_cnt == 0 || run[run_cnt - 1]->sector + 1 == entry->sector);
+
+    /* Anything that waits or does not extend the run ends it.
+       clean_run() drops cache_lock, so look SECTORS[I] up again. */
+    if (run_cnt > 0 && (busy || (entry != NULL && entry->dirty && !extends))) {
+      clean_run(block, run, run_cnt);
+      run_cnt = 0;
+    } else if (busy) {
+      cond_wait(&until_one_ready, &cache_lock);
+    } else {
+      if (entry != NULL && entry->dirty)
+        run[run_cnt++] = entry;
+      i++;
+    }
+  }
+  if (run_cnt > 0)
+    clean_run(block, run, run_cnt);
+  lock_release(&cache_lock);
+  lock_release(&writeback_lock);
 }
 
 void bufcache_flush(void) {
+  write_back(0);
+
+  /* Wait out any write the flusher still has in flight. */
+  lock_acquire(&writeback_lock);
   lock_acquire(&cache_lock);
-  for (int i = 0; i < NUM_ENTRIES; i++) {
-    if (entries[i].dirty && entries[i].ready) {
-      clean(fs_device, &entries[i]);
+  struct list_elem *e;
+  for (e = list_begin(&cache_pages); e != list_end(&cache_pages); e = list_next(e)) {
+    struct cache_page *page = list_entry(e, struct cache_page, elem);
+    for (int i = 0; i < ENTRIES_PER_PAGE; i++) {
+      while (!page->entries[i].ready)
+        cond_wait(&page->entries[i].until_ready, &cache_lock);
     }
   }
+  lock_release(&cache_lock);
+  lock_release(&writeback_lock);
+}
+
+/* Prints buffer cache hit statistics for each class of block. */
+void bufcache_print_stats(void) {
+  static const char *class_names[BC_CLASS_CNT] = {"data", "inode", "indirect", "dir"};
+
+  printf("Buffer cache (%s):", bufcache_policy == BUFCACHE_2Q ? "2q" : "lru");
+  for (int i = 0; i < BC_CLASS_CNT; i++) {
+    unsigned long long total = hit_cnt[i] + miss_cnt[i];
+    printf(" %s %llu/%llu hits (%llu%%)%s", class_names[i], hit_cnt[i], total,
+           total > 0 ? hit_cnt[i] * 100 / total : 0,
+           i + 1 < BC_CLASS_CNT ? "," : "\n");
+  }
 }
@@ -1,11 +1,52 @@
 #ifndef FILESYS_BUFCACHE_H
 #define FILESYS_BUFCACHE_H
 
+#include <stdbool.h>
 #include "devices/block.h"
 
+/* What a cached block holds.  Used to decide how long to keep it and
+   to break down the hit statistics. */
+enum bufcache_class
+  {
+    BC_DATA,                    /* File contents. */
+    BC_INODE,                   /* On-disk inode. */
+    BC_INDIRECT,                /* Indirect or doubly indirect block. */
+    BC_DIR,                     /* Directory contents. */
+    BC_CLASS_CNT
+  };
+
+/* Replacement policy, selected on the kernel command line. */
+enum bufcache_policy
+  {
+    BUFCACHE_LRU,               /* Plain least recently used. */
+    BUFCACHE_2Q                 /* Scan-resistant 2Q. */
+  };
+extern enum bufcache_policy bufcache_policy;
+
+/* Write-behind tuning, settable from the kernel command line. */
+extern unsigned bufcache_flush_interval;  /* Milliseconds between flushes. */
+extern unsigned bufcache_dirty_high;      /* % dirty that wakes the flusher. */
+extern unsigned bufcache_dirty_low;       /* % dirty it writes back down to. */
+
+/* Percentage of the kernel pool to use for the cache. */
+extern unsigned bufcache_pct;
+
+bool bufcache_set_policy(const char *name);
 void bufcache_init(void);
-void bufcache_read(struct block *block, block_sector_t sector, void* buffer, size_t offset, size_t length);
-void bufcache_write(struct block *block, block_sector_t sector, void* buffer, size_t offset, size_t length);
+void bufcache_read(struct block *block, block_sector_t sector, void* buffer, size_t offset, size_t length,
+                   enum bufcache_class cls);
+void bufcache_write(struct block *block, block_sector_t sector, void* buffer, size_t offset, size_t length,
+                    enum bufcache_class cls);
+void* bufcache_get(struct block *block, block_sector_t sector, enum bufcache_class cls);
+void bufcache_put(struct block *block, block_sector_t sector, bool dirty);
+void bufcache_hold(struct block *block, block_sector_t sector, enum bufcache_class cls);
+void bufcache_release(struct block *block, block_sector_t sector);
+size_t bufcache_hold_max(void);
+void bufcache_readahead(struct block *block, block_sector_t sector);
+void bufcache_discard(struct block *block, block_sector_t sector, size_t cnt);
 void bufcache_flush(void);
+void bufcache_on_flush(void (*hook)(void));
+void bufcache_flush_sectors(struct block *block, block_sector_t *sectors, size_t cnt);
+void bufcache_print_stats(void);
 
 #endif
@@ -0,0 +1,186 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Most names the cache remembers at once.  Beyond this, the least
+   recently used one is forgotten. */
+#define DCACHE_MAX 128
+
+/* The result of looking up NAME in the directory whose inode is in
+   sector DIR. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dentries. */
+    struct list_elem lru_elem;          /* Element in lru_list. */
+    block_sector_t dir;                 /* Directory's inode sector. */
+    char name[NAME_MAX + 1];            /* Null terminated file name. */
+    bool found;                         /* Does NAME exist in DIR? */
+    block_sector_t sector;              /* If so, its inode sector. */
+  };
+
+static struct hash dentries;
+static struct list lru_list;            /* Most recently used first. */
+static size_t dentry_cnt;
+
+/* Bumped by every invalidation, so that a lookup that raced with a
+   change to a directory does not cache what it saw before. */
+static unsigned generation;
+
+/* Protects everything above. */
+static struct lock dcache_lock;
+
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
+
+/* Returns the entry for NAME in DIR, or a null pointer if there is
+   none.  Must be called with dcache_lock held. */
+static struct dentry *
+find (block_sector_t dir, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  if (strlen (name) > NAME_MAX)
+    return NULL;
+  key.dir = dir;
+  strlcpy (key.name, name, sizeof key.name);
+  e = hash_find (&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Forgets D.  Must be called with dcache_lock held. */
+static void
+forget (struct dentry *d)
+{
+  hash_delete (&dentries, &d->hash_elem);
+  list_remove (&d->lru_elem);
+  dentry_cnt--;
+  free (d);
+}
+
+/* Initializes the dentry cache. */
+void
+dcache_init (void)
+{
+  if (!hash_init (&dentries, dentry_hash, dentry_less, NULL))
+    PANIC ("dentry cache creation failed");
+  list_init (&lru_list);
+  lock_init (&dcache_lock);
+}
+
+/* Returns the current generation, to be passed to dcache_insert()
+   along with what a directory search finds.  Take it before the
+   search begins. */
+unsigned
+dcache_generation (void)
+{
+  unsigned g;
+
+  lock_acquire (&dcache_lock);
+  g = generation;
+  lock_release (&dcache_lock);
+  return g;
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   Returns DCACHE_FOUND and sets *SECTORP to the sector of NAME's
+   inode if NAME is known to exist, DCACHE_ABSENT if it is known not
+   to, and DCACHE_MISS if the directory must be searched. */
+enum dcache_result
+dcache_lookup (block_sector_t dir, const char *name, block_sector_t *sectorp)
+{
+  enum dcache_result result = DCACHE_MISS;
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_front (&lru_list, &d->lru_elem);
+      if (d->found)
+        {
+          *sectorp = d->sector;
+          result = DCACHE_FOUND;
+        }
+      else
+        result = DCACHE_ABSENT;
+    }
+  lock_release (&dcache_lock);
+  return result;
+}
+
+/* Records that NAME exists in DIR with its inode in SECTOR, if
+   FOUND, or that it does not exist, if not.  Does nothing if the
+   cache was invalidated since dcache_generation() returned
+   GEN, or if memory is short. */
+void
+dcache_insert (unsigned gen, block_sector_t dir, const char *name,
+               bool found, block_sector_t sector)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  if (gen != generation)
+    goto done;
+
+  d = find (dir, name);
+  if (d != NULL)
+    list_remove (&d->lru_elem);
+  else
+    {
+      if (dentry_cnt >= DCACHE_MAX)
+        forget (list_entry (list_back (&lru_list), struct dentry, lru_elem));
+      d = malloc (sizeof *d);
+      if (d == NULL)
+        goto done;
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dentries, &d->hash_elem);
+      dentry_cnt++;
+    }
+  d->found = found;
+  d->sector = sector;
+  list_push_front (&lru_list, &d->lru_elem);
+
+ done:
+  lock_release (&dcache_lock);
+}
+
+/* Forgets anything known about NAME in DIR.  Call after adding or
+   removing NAME. */
+void
+dcache_invalidate (block_sector_t dir, const char *name)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  generation++;
+  d = find (dir, name);
+  if (d != NULL)
+    forget (d);
+  lock_release (&dcache_lock);
+}
@@ -0,0 +1,23 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Outcome of a dentry cache lookup. */
+enum dcache_result
+  {
+    DCACHE_MISS,                /* Nothing known; search the directory. */
+    DCACHE_FOUND,               /* The name exists. */
+    DCACHE_ABSENT               /* The name is known not to exist. */
+  };
+
+void dcache_init (void);
+unsigned dcache_generation (void);
+enum dcache_result dcache_lookup (block_sector_t dir, const char *name,
+                                  block_sector_t *sectorp);
+void dcache_insert (unsigned gen, block_sector_t dir, const char *name,
+                    bool found, block_sector_t sector);
+void dcache_invalidate (block_sector_t dir, const char *name);
+
+#endif /* filesys/dcache.h */
@@ -1,7 +1,10 @@
 #include "filesys/directory.h"
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
@@ -21,12 +24,132 @@ struct dir_entry
     bool in_use;                        /* In use or free? */
   };
 
+/* A directory starts out in the linear format: an array of
+   struct dir_entry, searched from the beginning.  Once it has
+   LINEAR_MAX entries and needs another, it is rewritten in the
+   hashed format, a header block followed by blocks of entries.
+   Blocks 1 through BUCKET_CNT are buckets; a name's entry goes in
+   the bucket chosen by the hash of the name, or, if that bucket is
+   full, in an overflow block chained from it.  Lookup, insert and
+   remove then read the header and usually a single bucket.
+
+   The header always stays in block 0 of the file, but the blocks
+   after it are numbered from BASE, so that a rehash can build the
+   new table in blocks the old one does not use and then switch to
+   it with one write of the header.
+
+   Every lookup, insert and remove holds the lock from
+   inode_lock_dir() across its reads and writes of the header and
+   slots, since each opener of a directory has its own struct dir. */
+#define LINEAR_MAX 32
+
+/* Most blocks a rehash writes.  Allocating them must log no more
+   indirect and free map blocks than one journal operation may. */
+#define TABLE_MAX 512
+
+/* Marks a directory in the hashed format.  It overlays the
+   inode_sector of a linear directory's first entry, and is larger
+   than any sector number the IDE driver can address. */
+#define DIR_MAGIC 0x48534944
+
+/* Block 0 of a directory in the hashed format. */
+struct dir_header
+  {
+    block_sector_t magic;               /* DIR_MAGIC. */
+    uint32_t bucket_cnt;                /* Number of buckets. */
+    uint32_t block_cnt;                 /* Blocks in use, with header. */
+    uint32_t entry_cnt;                 /* Entries in use. */
+    uint32_t base;                      /* Block where block 0 would be. */
+  };
+
+/* Entries in one block of a directory in the hashed format. */
+#define BUCKET_ENTRIES \
+  ((BLOCK_SECTOR_SIZE - sizeof (uint32_t)) / sizeof (struct dir_entry))
+
+/* A bucket or overflow block.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct dir_bucket
+  {
+    struct dir_entry entries[BUCKET_ENTRIES];
+    uint32_t next;                      /* Next overflow block, or 0. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - BUCKET_ENTRIES
+                   * sizeof (struct dir_entry) - sizeof (uint32_t)];
+  };
+
+/* Reads DIR's header into *H.  Returns true if DIR is in the
+   hashed format, false if it is linear. */
+static bool
+read_header (const struct dir *dir, struct dir_header *h)
+{
+  return (inode_read_at (dir->inode, h, sizeof *h, 0) == sizeof *h
+          && h->magic == DIR_MAGIC);
+}
+
+/* Writes H as DIR's header.  Returns true if successful. */
+static bool
+write_header (struct dir *dir, const struct dir_header *h)
+{
+  return inode_write_at (dir->inode, h, sizeof *h, 0) == sizeof *h;
+}
+
+/* Returns the bucket for NAME in a directory with BUCKET_CNT
+   buckets. */
+static uint32_t
+bucket_of (uint32_t bucket_cnt, const char *name)
+{
+  return 1 + hash_string (name) % bucket_cnt;
+}
+
+/* Returns the byte offset of entry SLOT in block BLOCK of a
+   directory in the hashed format with header H.  Slot
+   BUCKET_ENTRIES is the block's link to its next overflow block. */
+static off_t
+slot_ofs (const struct dir_header *h, uint32_t block, size_t slot)
+{
+  return ((off_t) (h->base + block) * BLOCK_SECTOR_SIZE
+          + slot * sizeof (struct dir_entry));
+}
+
+/* Reads into *NEXTP the overflow block that follows BLOCK in the
+   hashed directory DIR, which has header H.  Returns true if
+   successful. */
+static bool
+read_next (const struct dir *dir, const struct dir_header *h, uint32_t block,
+           uint32_t *nextp)
+{
+  off_t ofs = slot_ofs (h, block, BUCKET_ENTRIES);
+  return inode_read_at (dir->inode, nextp, sizeof *nextp, ofs) == sizeof *nextp;
+}
+
+/* Reads the entry at *POSP in DIR into *EP and advances *POSP past
+   it.  H is DIR's header if DIR is in the hashed format, otherwise
+   a null pointer.  Returns false at the end of the directory. */
+static bool
+read_slot (const struct dir *dir, const struct dir_header *h,
+           off_t *posp, struct dir_entry *ep)
+{
+  if (h != NULL)
+    {
+      if (*posp < slot_ofs (h, 1, 0))
+        *posp = slot_ofs (h, 1, 0);
+      else if (*posp % BLOCK_SECTOR_SIZE
+               >= (off_t) (BUCKET_ENTRIES * sizeof *ep))
+        *posp = ROUND_UP (*posp, BLOCK_SECTOR_SIZE);
+      if (*posp >= slot_ofs (h, h->block_cnt, 0))
+        return false;
+    }
+  if (inode_read_at (dir->inode, ep, sizeof *ep, *posp) != sizeof *ep)
+    return false;
+  *posp += sizeof *ep;
+  return true;
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool
 dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  return inode_create (sector, entry_cnt * sizeof (struct dir_entry));
+  return inode_create (sector, entry_cnt * sizeof (struct dir_entry), true);
 }
 
 /* Opens and returns the directory for the given INODE, of which
@@ -92,42 +215,261 @@ static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp)
 {
+  struct dir_header h;
   struct dir_entry e;
-  size_t ofs;
+  off_t ofs;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  if (read_header (dir, &h))
+    {
+      uint32_t block = bucket_of (h.bucket_cnt, name);
+      size_t slot;
+
+      while (block != 0 && block < h.block_cnt)
+        {
+          for (slot = 0; slot < BUCKET_ENTRIES; slot++)
+            {
+              ofs = slot_ofs (&h, block, slot);
+              if (inode_read_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
+                return false;
+              if (e.in_use && !strcmp (name, e.name))
+                goto found;
+            }
+          if (!read_next (dir, &h, block, &block))
+            return false;
+        }
+      return false;
+    }
+
   for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
        ofs += sizeof e)
     if (e.in_use && !strcmp (name, e.name))
+      goto found;
+  return false;
+
+ found:
+  if (ep != NULL)
+    *ep = e;
+  if (ofsp != NULL)
+    *ofsp = ofs;
+  return true;
+}
+
+/* Adds E to the hashed directory image BLOCKS, which has
+   *BLOCK_CNT blocks and BUCKET_CNT buckets, appending an overflow
+   block if E's bucket is full.  Returns the image, which may have
+   moved, or a null pointer if memory is exhausted, in which case
+   BLOCKS has been freed. */
+static struct dir_bucket *
+image_add (struct dir_bucket *blocks, uint32_t *block_cnt,
+           uint32_t bucket_cnt, const struct dir_entry *e)
+{
+  uint32_t block = bucket_of (bucket_cnt, e->name);
+  struct dir_bucket *grown;
+  size_t slot;
+
+  for (;;)
+    {
+      for (slot = 0; slot < BUCKET_ENTRIES; slot++)
+        if (!blocks[block].entries[slot].in_use)
+          {
+            blocks[block].entries[slot] = *e;
+            return blocks;
+          }
+      if (blocks[block].next == 0)
+        break;
+      block = blocks[block].next;
+    }
+
+  grown = realloc (blocks, (*block_cnt + 1) * sizeof *blocks);
+  if (grown == NULL)
+    {
+      free (blocks);
+      return NULL;
+    }
+  blocks = grown;
+  memset (&blocks[*block_cnt], 0, sizeof *blocks);
+  blocks[*block_cnt].entries[0] = *e;
+  blocks[block].next = (*block_cnt)++;
+  return blocks;
+}
+
+/* Rewrites DIR in the hashed format, adding E if it is non-null,
+   with enough buckets that they are about half full.  DIR may be
+   in either format to begin with.  The new table is built in
+   memory and written, unlogged, to blocks of DIR's file that the
+   old contents do not use, so that DIR is left as it was if memory
+   is short, its file cannot grow, or the system stops before the
+   new header is committed.  Returns true if successful, false on
+   failure. */
+static bool
+rehash (struct dir *dir, const struct dir_entry *e)
+{
+  struct dir_header h;
+  bool hashed = read_header (dir, &h);
+  struct dir_bucket *blocks = NULL;
+  struct dir_entry *entries;
+  struct dir_entry slot;
+  size_t entry_max, cnt, i;
+  uint32_t old_start, old_end;
+  off_t pos = 0;
+  bool success = false;
+
+  ASSERT (sizeof *blocks == BLOCK_SECTOR_SIZE);
+
+  /* Gather the entries in use. */
+  entry_max = (hashed ? h.entry_cnt
+               : inode_length (dir->inode) / sizeof slot) + 1;
+  entries = malloc (entry_max * sizeof *entries);
+  if (entries == NULL)
+    return false;
+  cnt = 0;
+  while (read_slot (dir, hashed ? &h : NULL, &pos, &slot))
+    if (slot.in_use)
       {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
-        return true;
+        if (cnt >= entry_max)
+          goto done;
+        entries[cnt++] = slot;
       }
-  return false;
+  if (e != NULL)
+    {
+      if (cnt >= entry_max)
+        goto done;
+      entries[cnt++] = *e;
+    }
+
+  /* Blocks the old contents use, not counting the header. */
+  if (hashed)
+    {
+      old_start = h.base + 1;
+      old_end = h.base + h.block_cnt;
+    }
+  else
+    {
+      old_start = 0;
+      old_end = DIV_ROUND_UP (inode_length (dir->inode), BLOCK_SECTOR_SIZE);
+    }
+
+  /* Lay them out in buckets. */
+  h.magic = DIR_MAGIC;
+  h.bucket_cnt = DIV_ROUND_UP (cnt * 2, BUCKET_ENTRIES);
+  if (h.bucket_cnt == 0)
+    h.bucket_cnt = 1;
+  h.block_cnt = h.bucket_cnt + 1;
+  h.entry_cnt = cnt;
+  blocks = calloc (h.block_cnt, sizeof *blocks);
+  for (i = 0; blocks != NULL && i < cnt; i++)
+    blocks = image_add (blocks, &h.block_cnt, h.bucket_cnt, &entries[i]);
+  if (blocks == NULL || h.block_cnt > TABLE_MAX)
+    goto done;
+
+  /* Put the new table before the old one if it fits there, and
+     otherwise after it.  Its block 0 is never read. */
+  h.base = h.block_cnt <= old_start ? 0 : old_end;
+  success = (inode_write_unlogged (dir->inode, blocks + 1,
+                                   (h.block_cnt - 1) * sizeof *blocks,
+                                   slot_ofs (&h, 1, 0))
+             == (off_t) ((h.block_cnt - 1) * sizeof *blocks)
+             && write_header (dir, &h));
+
+ done:
+  free (blocks);
+  free (entries);
+  return success;
+}
+
+/* Writes E into a free slot of its bucket in DIR, which is in the
+   hashed format with header *H, appending an overflow block to the
+   bucket if it is full.  Updates *H but does not write it.
+   Returns true if successful, false on failure. */
+static bool
+hashed_add (struct dir *dir, struct dir_header *h, const struct dir_entry *e)
+{
+  static const struct dir_bucket empty;
+  uint32_t block = bucket_of (h->bucket_cnt, e->name);
+  uint32_t next;
+  struct dir_entry slot;
+  size_t i;
+  off_t ofs;
+
+  for (;;)
+    {
+      for (i = 0; i < BUCKET_ENTRIES; i++)
+        {
+          ofs = slot_ofs (h, block, i);
+          if (inode_read_at (dir->inode, &slot, sizeof slot, ofs) != sizeof slot)
+            return false;
+          if (!slot.in_use)
+            goto found;
+        }
+      if (!read_next (dir, h, block, &next))
+        return false;
+      if (next == 0)
+        break;
+      block = next;
+    }
+
+  /* Every slot in the chain is taken. */
+  next = h->block_cnt;
+  if (inode_write_at (dir->inode, &empty, sizeof empty, slot_ofs (h, next, 0))
+      != sizeof empty)
+    return false;
+  h->block_cnt++;
+  if (inode_write_at (dir->inode, &next, sizeof next,
+                      slot_ofs (h, block, BUCKET_ENTRIES)) != sizeof next)
+    return false;
+  ofs = slot_ofs (h, next, 0);
+
+ found:
+  if (inode_write_at (dir->inode, e, sizeof *e, ofs) != sizeof *e)
+    return false;
+  h->entry_cnt++;
+  return true;
 }
 
 /* Searches DIR for a file with the given NAME
    and returns true if one exists, false otherwise.
    On success, sets *INODE to an inode for the file, otherwise to
-   a null pointer.  The caller must close *INODE. */
+   a null pointer.  The caller must close *INODE.
+   Recent results, whether found or not, are answered from the
+   dentry cache without reading DIR. */
 bool
 dir_lookup (const struct dir *dir, const char *name,
             struct inode **inode)
 {
+  block_sector_t dir_sector;
+  block_sector_t sector;
+  enum dcache_result cached;
   struct dir_entry e;
+  unsigned gen;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  if (lookup (dir, name, &e, NULL))
-    *inode = inode_open (e.inode_sector);
-  else
+  dir_sector = inode_get_inumber (dir->inode);
+  cached = dcache_lookup (dir_sector, name, &sector);
+  if (cached == DCACHE_FOUND)
+    *inode = inode_open (sector);
+  else if (cached == DCACHE_ABSENT)
     *inode = NULL;
+  else
+    {
+      gen = dcache_generation ();
+      inode_lock_dir (dir->inode);
+      if (lookup (dir, name, &e, NULL))
+        {
+          dcache_insert (gen, dir_sector, name, true, e.inode_sector);
+          *inode = inode_open (e.inode_sector);
+        }
+      else
+        {
+          dcache_insert (gen, dir_sector, name, false, 0);
+          *inode = NULL;
+        }
+      inode_unlock_dir (dir->inode);
+    }
 
   return *inode != NULL;
 }
@@ -141,6 +483,7 @@ dir_lookup (const struct dir *dir, const char *name,
 bool
 dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 {
+  struct dir_header h;
   struct dir_entry e;
   off_t ofs;
   bool success = false;
@@ -152,10 +495,28 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
+  inode_lock_dir (dir->inode);
+
   /* Check that NAME is not in use. */
   if (lookup (dir, name, NULL, NULL))
     goto done;
 
+  if (read_header (dir, &h))
+    {
+      e.in_use = true;
+      strlcpy (e.name, name, sizeof e.name);
+      e.inode_sector = inode_sector;
+      success = hashed_add (dir, &h, &e);
+      if (!write_header (dir, &h))
+        success = false;
+
+      /* Spread the entries over more buckets once they are three
+         quarters full.  If that fails, the chains just grow. */
+      if (success && h.entry_cnt * 4 > h.bucket_cnt * BUCKET_ENTRIES * 3)
+        rehash (dir, NULL);
+      goto done;
+    }
+
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
      current end-of-file.
@@ -168,13 +529,19 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
     if (!e.in_use)
       break;
 
-  /* Write slot. */
+  /* Write slot, switching to the hashed format instead of
+     growing a directory that is already large. */
   e.in_use = true;
   strlcpy (e.name, name, sizeof e.name);
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  if (ofs >= (off_t) (LINEAR_MAX * sizeof e) && rehash (dir, &e))
+    success = true;
+  else
+    success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
  done:
+  dcache_invalidate (inode_get_inumber (dir->inode), name);
+  inode_unlock_dir (dir->inode);
   return success;
 }
 
@@ -184,6 +551,7 @@ dir_add (struct dir *dir, const char *name, block_sector_t inode_sector)
 bool
 dir_remove (struct dir *dir, const char *name)
 {
+  struct dir_header h;
   struct dir_entry e;
   struct inode *inode = NULL;
   bool success = false;
@@ -192,6 +560,8 @@ dir_remove (struct dir *dir, const char *name)
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
+  inode_lock_dir (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -205,12 +575,19 @@ dir_remove (struct dir *dir, const char *name)
   e.in_use = false;
   if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
     goto done;
+  dcache_invalidate (inode_get_inumber (dir->inode), name);
+  if (read_header (dir, &h))
+    {
+      h.entry_cnt--;
+      write_header (dir, &h);
+    }
 
   /* Remove inode. */
   inode_remove (inode);
   success = true;
 
  done:
+  inode_unlock_dir (dir->inode);
   inode_close (inode);
   return success;
 }
@@ -221,16 +598,20 @@ dir_remove (struct dir *dir, const char *name)
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
+  struct dir_header h;
   struct dir_entry e;
+  bool hashed;
+  bool found = false;
 
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e)
-    {
-      dir->pos += sizeof e;
-      if (e.in_use)
-        {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          return true;
-        }
-    }
-  return false;
+  inode_lock_dir (dir->inode);
+  hashed = read_header (dir, &h);
+  while (read_slot (dir, hashed ? &h : NULL, &dir->pos, &e))
+    if (e.in_use)
+      {
+        strlcpy (name, e.name, NAME_MAX + 1);
+        found = true;
+        break;
+      }
+  inode_unlock_dir (dir->inode);
+  return found;
 }
@@ -9,6 +9,7 @@ struct file
     struct inode *inode;        /* File's inode. */
     off_t pos;                  /* Current position. */
     bool deny_write;            /* Has file_deny_write() been called? */
+    bool direct;                /* Bypass the buffer cache? */
   };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -23,6 +24,7 @@ file_open (struct inode *inode)
       file->inode = inode;
       file->pos = 0;
       file->deny_write = false;
+      file->direct = false;
       return file;
     }
   else
@@ -68,7 +70,7 @@ file_get_inode (struct file *file)
 off_t
 file_read (struct file *file, void *buffer, off_t size)
 {
-  off_t bytes_read = inode_read_at (file->inode, buffer, size, file->pos);
+  off_t bytes_read = file_read_at (file, buffer, size, file->pos);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -81,6 +83,8 @@ file_read (struct file *file, void *buffer, off_t size)
 off_t
 file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs)
 {
+  if (file->direct)
+    return inode_read_direct (file->inode, buffer, size, file_ofs);
   return inode_read_at (file->inode, buffer, size, file_ofs);
 }
 
@@ -94,7 +98,7 @@ file_read_at (struct file *file, void *buffer, off_t size, off_t file_ofs)
 off_t
 file_write (struct file *file, const void *buffer, off_t size)
 {
-  off_t bytes_written = inode_write_at (file->inode, buffer, size, file->pos);
+  off_t bytes_written = file_write_at (file, buffer, size, file->pos);
   file->pos += bytes_written;
   return bytes_written;
 }
@@ -110,6 +114,8 @@ off_t
 file_write_at (struct file *file, const void *buffer, off_t size,
                off_t file_ofs)
 {
+  if (file->direct)
+    return inode_write_direct (file->inode, buffer, size, file_ofs);
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
@@ -148,6 +154,34 @@ file_length (struct file *file)
   return inode_length (file->inode);
 }
 
+/* Writes FILE's data and inode to disk, returning once they are
+   durable. */
+void
+file_sync (struct file *file)
+{
+  ASSERT (file != NULL);
+  inode_sync (file->inode);
+}
+
+/* Reserves disk space for the first SIZE bytes of FILE, without
+   changing its length, so that writes that later grow FILE into
+   that space need not allocate.  Returns true if successful. */
+bool
+file_allocate (struct file *file, off_t size)
+{
+  ASSERT (file != NULL);
+  return inode_allocate (file->inode, size);
+}
+
+/* Makes reads and writes of whole blocks of FILE bypass the buffer
+   cache if DIRECT is true, or go through it again if false. */
+void
+file_set_direct (struct file *file, bool direct)
+{
+  ASSERT (file != NULL);
+  file->direct = direct;
+}
+
 /* Sets the current position in FILE to NEW_POS bytes from the
    start of the file. */
 void
@@ -1,6 +1,7 @@
 #ifndef FILESYS_FILE_H
 #define FILESYS_FILE_H
 
+#include <stdbool.h>
 #include "filesys/off_t.h"
 
 struct inode;
@@ -26,4 +27,13 @@ void file_seek (struct file *, off_t);
 off_t file_tell (struct file *);
 off_t file_length (struct file *);
 
+/* Durability. */
+void file_sync (struct file *);
+
+/* Space management. */
+bool file_allocate (struct file *, off_t size);
+
+/* Unbuffered I/O. */
+void file_set_direct (struct file *, bool);
+
 #endif /* filesys/file.h */
@@ -2,14 +2,41 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/bufcache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
 
 /* Partition that contains the file system. */
 struct block *fs_device;
 
+/* Sectors in each file system block.  Set from the kernel command
+   line for formatting, and otherwise from the super block. */
+unsigned fs_cluster = 1;
+
+bool filesys_sync_at_shutdown = true;
+
+/* Identifies a super block. */
+#define SUPER_MAGIC 0x52505553
+
+/* Sector SUPER_SECTOR.  Read before anything else on the disk,
+   since the cluster size it records gives the place of everything
+   else. */
+struct super_block
+  {
+    uint32_t magic;                     /* SUPER_MAGIC. */
+    uint32_t cluster;                   /* Sectors per block. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 8];
+  };
+
+/* Longest run of sectors filesys_read_blocks() and
+   filesys_write_blocks() hand the device at once. */
+#define RUN_SECTORS 64
+
+static void read_super (void);
 static void do_format (void);
 
 /* Initializes the file system module.
@@ -21,11 +48,18 @@ filesys_init (bool format)
   if (fs_device == NULL)
     PANIC ("No file system device found, can't initialize file system.");
 
+  if (!format)
+    read_super ();
+  bufcache_init ();
+  journal_init ();
+  dcache_init ();
   inode_init ();
   free_map_init ();
 
   if (format)
     do_format ();
+  else
+    journal_recover ();
 
   free_map_open ();
 }
@@ -35,29 +69,51 @@ filesys_init (bool format)
 void
 filesys_done (void)
 {
+  /* Nothing to do if we panicked before filesys_init(), or if
+     asked to go down as if the power failed. */
+  if (fs_device == NULL || !filesys_sync_at_shutdown)
+    return;
+
+  filesys_sync ();
   free_map_close ();
+  journal_commit ();
+  bufcache_flush ();
 }
 
-/* Creates a file named NAME with the given INITIAL_SIZE.
-   Returns true if successful, false otherwise.
-   Fails if a file named NAME already exists,
-   or if internal memory allocation fails. */
-bool
-filesys_create (const char *name, off_t initial_size)
+/* Creates a file named NAME with the given INITIAL_SIZE, in a
+   single operation.  Returns true if successful. */
+static bool
+create (const char *name, off_t initial_size)
 {
   block_sector_t inode_sector = 0;
+  journal_begin ();
   struct dir *dir = dir_open_root ();
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
-                  && inode_create (inode_sector, initial_size)
+                  && free_map_allocate_near (inode_get_inumber (dir_get_inode (dir)),
+                                             1, &inode_sector)
+                  && inode_create (inode_sector, initial_size, false)
                   && dir_add (dir, name, inode_sector));
   if (!success && inode_sector != 0)
     free_map_release (inode_sector, 1);
   dir_close (dir);
+  journal_end ();
 
   return success;
 }
 
+/* Creates a file named NAME with the given INITIAL_SIZE.
+   Returns true if successful, false otherwise.
+   Fails if a file named NAME already exists,
+   or if internal memory allocation fails.
+   If the disk is full but free_map_make_room() finds sectors
+   waiting for a commit, tries once more. */
+bool
+filesys_create (const char *name, off_t initial_size)
+{
+  return (create (name, initial_size)
+          || (free_map_make_room () && create (name, initial_size)));
+}
+
 /* Opens the file with the given NAME.
    Returns the new file if successful or a null pointer
    otherwise.
@@ -83,21 +139,132 @@ filesys_open (const char *name)
 bool
 filesys_remove (const char *name)
 {
+  journal_begin ();
   struct dir *dir = dir_open_root ();
   bool success = dir != NULL && dir_remove (dir, name);
   dir_close (dir);
+  journal_end ();
 
   return success;
 }
 
+/* Writes everything the file system holds in memory to disk, and
+   commits the journal.  Sectors released since the last sync are
+   marked free on disk only after that, once nothing on disk refers
+   to them any more. */
+void
+filesys_sync (void)
+{
+  inode_sync_all ();
+  free_map_commit ();
+  free_map_sync ();
+}
+
+/* Sets the number of sectors in each block of a file system about
+   to be formatted to SECTORS, which must be a power of 2 no greater
+   than FS_CLUSTER_MAX.  Returns false if it is not. */
+bool
+filesys_set_cluster (int sectors)
+{
+  if (sectors < 1 || sectors > FS_CLUSTER_MAX || (sectors & (sectors - 1)))
+    return false;
+  fs_cluster = sectors;
+  return true;
+}
+
+/* Reads file system block SECTOR of BLOCK into BUFFER, which must
+   have room for FS_BLOCK_SIZE bytes. */
+void
+filesys_read_block (struct block *block, block_sector_t sector, void *buffer)
+{
+  filesys_read_blocks (block, sector, 1, &buffer);
+}
+
+/* Reads CNT consecutive file system blocks from BLOCK, starting at
+   SECTOR, the Ith of them into BUFFERS[I], in runs of up to
+   RUN_SECTORS sectors. */
+void
+filesys_read_blocks (struct block *block, block_sector_t sector, size_t cnt,
+                     void *buffers[])
+{
+  void *run[RUN_SECTORS];
+  size_t total = cnt * fs_cluster;
+  size_t done = 0;
+  size_t i;
+
+  for (i = 0; i < total; i++)
+    {
+      run[i - done] = ((uint8_t *) buffers[i / fs_cluster]
+                       + i % fs_cluster * BLOCK_SECTOR_SIZE);
+      if (i + 1 - done == RUN_SECTORS || i + 1 == total)
+        {
+          block_read_run (block, sector * fs_cluster + done, i + 1 - done, run);
+          done = i + 1;
+        }
+    }
+}
+
+/* Writes CNT consecutive file system blocks to BLOCK, starting at
+   SECTOR, the Ith of them from BUFFERS[I], in runs of up to
+   RUN_SECTORS sectors. */
+void
+filesys_write_blocks (struct block *block, block_sector_t sector, size_t cnt,
+                      const void *buffers[])
+{
+  const void *run[RUN_SECTORS];
+  size_t total = cnt * fs_cluster;
+  size_t done = 0;
+  size_t i;
+
+  for (i = 0; i < total; i++)
+    {
+      run[i - done] = ((const uint8_t *) buffers[i / fs_cluster]
+                       + i % fs_cluster * BLOCK_SECTOR_SIZE);
+      if (i + 1 - done == RUN_SECTORS || i + 1 == total)
+        {
+          block_write_run (block, sector * fs_cluster + done, i + 1 - done, run);
+          done = i + 1;
+        }
+    }
+}
+
+/* Reads the cluster size from the super block. */
+static void
+read_super (void)
+{
+  struct super_block super;
+
+  ASSERT (sizeof super == BLOCK_SECTOR_SIZE);
+  block_read (fs_device, SUPER_SECTOR, &super);
+  if (super.magic != SUPER_MAGIC || !filesys_set_cluster (super.cluster))
+    PANIC ("file system has no super block, reformat it");
+}
+
+/* Writes a super block recording the cluster size. */
+static void
+write_super (void)
+{
+  struct super_block super;
+
+  memset (&super, 0, sizeof super);
+  super.magic = SUPER_MAGIC;
+  super.cluster = fs_cluster;
+  block_write (fs_device, SUPER_SECTOR, &super);
+}
+
 /* Formats the file system. */
 static void
 do_format (void)
 {
   printf ("Formatting file system...");
+  write_super ();
+  journal_create ();
   free_map_create ();
+  journal_begin ();
   if (!dir_create (ROOT_DIR_SECTOR, 16))
     PANIC ("root directory creation failed");
+  journal_end ();
   free_map_close ();
+  journal_commit ();
   printf ("done.\n");
 }
@@ -3,18 +3,42 @@
 
 #include <stdbool.h>
 #include "filesys/off_t.h"
+#include "devices/block.h"
 
-/* Sectors of system file inodes. */
-#define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
-#define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+/* The file system allocates, maps and caches its device in blocks
+   of FS_BLOCK_SIZE bytes, each a cluster of fs_cluster consecutive
+   sectors, fixed when the disk is formatted.  Every block_sector_t
+   the file system passes around, inode numbers included, counts
+   these blocks; with the default cluster of one sector they are
+   plain sectors. */
+#define FS_CLUSTER_MAX 8        /* Sectors in a page. */
+extern unsigned fs_cluster;
+#define FS_BLOCK_SIZE ((off_t) (fs_cluster * BLOCK_SECTOR_SIZE))
+
+/* Blocks of system file inodes. */
+#define SUPER_SECTOR 0          /* Super block, giving the cluster size. */
+#define FREE_MAP_SECTOR 1       /* Free map file inode sector. */
+#define ROOT_DIR_SECTOR 2       /* Root directory file inode sector. */
+#define JOURNAL_SECTOR 3        /* First sector of the journal. */
 
 /* Block device that contains the file system. */
 struct block *fs_device;
 
+/* If false, filesys_done() leaves unwritten data unwritten, as a
+   crash would.  Set from the kernel command line. */
+extern bool filesys_sync_at_shutdown;
+
 void filesys_init (bool format);
 void filesys_done (void);
 bool filesys_create (const char *name, off_t initial_size);
 struct file *filesys_open (const char *name);
 bool filesys_remove (const char *name);
+void filesys_sync (void);
+bool filesys_set_cluster (int sectors);
+void filesys_read_block (struct block *, block_sector_t, void *);
+void filesys_read_blocks (struct block *, block_sector_t, size_t cnt,
+                          void *buffers[]);
+void filesys_write_blocks (struct block *, block_sector_t, size_t cnt,
+                           const void *buffers[]);
 
 #endif /* filesys/filesys.h */
@@ -1,24 +1,174 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "threads/synch.h"
 
+/* Number of free map bits held by one sector of the free map file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* The disk is divided into allocation groups of GROUP_SECTORS
+   blocks.  An allocation with a goal is kept within the goal's
+   group when possible, so that a file's blocks stay near each other
+   and near its inode. */
+#define GROUP_SECTORS 1024
+
 static struct file *free_map_file;   /* Free map file. */
-static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *free_map;      /* Free map, one bit per block. */
 static struct lock free_map_lock;
 
+/* The free map as it stands in the free map file.  Allocations are
+   copied here, and written to the file, as they happen.  Releases
+   are not: a released sector stays marked in use on disk until
+   free_map_commit() runs, after the unlink that released it has
+   itself reached the disk.  That way a sector is never marked free
+   on disk while an inode there still refers to it. */
+static struct bitmap *disk_map;
+
+/* One bit per free map file sector that holds releases not yet
+   copied to DISK_MAP. */
+static struct bitmap *released;
+
+/* Sectors released, but not yet free in FREE_MAP, because the
+   operations that stopped using them may not have committed.  Until
+   they do, the journal may still hold a sector's old contents in the
+   buffer cache, and a crash would bring back whatever used it, so
+   handing it out again could hand out a sector in use.  PENDING_COMMIT
+   is journal_commit_cnt() as of the latest release. */
+static struct bitmap *pending;
+static size_t pending_cnt;
+static unsigned pending_commit;
+
+/* Called by free_map_make_room(), to wait for sectors that are
+   being released. */
+static void (*full_hook) (void);
+
+/* Writes the bits of DISK_MAP for sectors SECTOR through
+   SECTOR + CNT - 1 to the free map file, if it is open.  Only the
+   few bytes that hold those bits are written, not the whole map.
+   Returns true if successful. */
+static bool
+write_range (block_sector_t sector, size_t cnt)
+{
+  return free_map_file == NULL
+         || bitmap_write_bits (disk_map, free_map_file, sector, cnt);
+}
+
+/* Notes that CNT sectors starting at SECTOR are marked in use in
+   DISK_MAP but may not be in FREE_MAP. */
+static void
+mark_released (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+  bitmap_set_multiple (released, first, last - first + 1, true);
+}
+
+/* Frees the sectors in PENDING in FREE_MAP, if the journal has
+   committed since they were released. */
+static void
+settle_pending (void)
+{
+  size_t start = 0;
+
+  if (pending_cnt == 0 || journal_commit_cnt () == pending_commit)
+    return;
+  while (pending_cnt > 0)
+    {
+      size_t end;
+
+      start = bitmap_scan (pending, start, 1, true);
+      ASSERT (start != BITMAP_ERROR);
+      end = bitmap_scan (pending, start, 1, false);
+      if (end == BITMAP_ERROR)
+        end = bitmap_size (pending);
+      bitmap_set_multiple (pending, start, end - start, false);
+      bitmap_set_multiple (free_map, start, end - start, false);
+      mark_released (start, end - start);
+      pending_cnt -= end - start;
+      start = end;
+    }
+}
+
+/* Adds CNT sectors starting at SECTOR, which are in use, to
+   PENDING. */
+static void
+release_pending (block_sector_t sector, size_t cnt)
+{
+  settle_pending ();
+  ASSERT (bitmap_all (free_map, sector, cnt));
+  ASSERT (bitmap_none (pending, sector, cnt));
+  bitmap_set_multiple (pending, sector, cnt, true);
+  pending_cnt += cnt;
+  pending_commit = journal_commit_cnt ();
+}
+
+/* Marks CNT sectors starting at SECTOR in use both in memory and on
+   disk, undoing the change if the free map file cannot be written.
+   Returns true if successful. */
+static bool
+mark_allocated (block_sector_t sector, size_t cnt)
+{
+  bitmap_set_multiple (free_map, sector, cnt, true);
+  bitmap_set_multiple (disk_map, sector, cnt, true);
+  if (!write_range (sector, cnt))
+    {
+      bitmap_set_multiple (free_map, sector, cnt, false);
+      mark_released (sector, cnt);
+      return false;
+    }
+  return true;
+}
+
+/* Returns the first sector of a run of CNT free sectors, searching
+   first from GOAL to the end of GOAL's allocation group, then from
+   the start of that group, then the groups that follow it, wrapping
+   around at the end of the disk.  Returns BITMAP_ERROR if there is
+   no such run. */
+static size_t
+scan_near (block_sector_t goal, size_t cnt)
+{
+  if (goal >= bitmap_size (free_map))
+    goal = 0;
+
+  size_t group_start = goal / GROUP_SECTORS * GROUP_SECTORS;
+  size_t after = bitmap_scan (free_map, goal, cnt, false);
+  if (after != BITMAP_ERROR && after < group_start + GROUP_SECTORS)
+    return after;
+
+  size_t before = bitmap_scan (free_map, group_start, cnt, false);
+  if (before != BITMAP_ERROR && before < goal)
+    return before;
+
+  return after != BITMAP_ERROR ? after : bitmap_scan (free_map, 0, cnt, false);
+}
+
 /* Initializes the free map. */
 void
 free_map_init (void)
 {
-  free_map = bitmap_create (block_size (fs_device));
-  if (free_map == NULL)
+  size_t blocks = block_size (fs_device) / fs_cluster;
+
+  free_map = bitmap_create (blocks);
+  disk_map = bitmap_create (blocks);
+  released = bitmap_create (DIV_ROUND_UP (blocks, BITS_PER_SECTOR));
+  pending = bitmap_create (blocks);
+  if (free_map == NULL || disk_map == NULL || released == NULL
+      || pending == NULL
+      || !bitmap_enable_summary (free_map))
     PANIC ("bitmap creation failed--file system device is too large");
+  bitmap_mark (free_map, SUPER_SECTOR);
+  bitmap_mark (disk_map, SUPER_SECTOR);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_mark (disk_map, FREE_MAP_SECTOR);
+  bitmap_mark (disk_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  bitmap_set_multiple (disk_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
   lock_init(&free_map_lock);
 }
 
@@ -29,31 +179,144 @@ free_map_init (void)
    written. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
+{
+  return free_map_allocate_near (0, cnt, sectorp);
+}
+
+/* Allocates CNT consecutive sectors from the free map, as near to
+   GOAL as possible, and stores the first into *SECTORP.  Callers
+   pass a sector the new ones belong with, such as the inode or the
+   last block of the file being extended.
+   Returns true if successful, false if not enough consecutive
+   sectors were available or if the free_map file could not be
+   written. */
+bool
+free_map_allocate_near (block_sector_t goal, size_t cnt, block_sector_t *sectorp)
 {
   lock_acquire(&free_map_lock);
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
-    {
-      bitmap_set_multiple (free_map, sector, cnt, false);
-      sector = BITMAP_ERROR;
-    }
+  settle_pending ();
+  block_sector_t sector = scan_near (goal, cnt);
+  if (sector != BITMAP_ERROR && !mark_allocated (sector, cnt))
+    sector = BITMAP_ERROR;
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   lock_release(&free_map_lock);
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates up to CNT consecutive free sectors beginning at
+   SECTOR, stopping short at the first sector in use or at the end
+   of the device.  Returns the number of sectors allocated, which is
+   0 if SECTOR itself is in use or the free_map file could not be
+   written. */
+size_t
+free_map_allocate_at (block_sector_t sector, size_t cnt)
+{
+  size_t size = bitmap_size (free_map);
+  size_t got = 0;
+
+  lock_acquire(&free_map_lock);
+  settle_pending ();
+  while (got < cnt && sector + got < size && !bitmap_test (free_map, sector + got))
+    got++;
+  if (got > 0 && !mark_allocated (sector, got))
+    got = 0;
+  lock_release(&free_map_lock);
+  return got;
+}
+
+/* Makes CNT sectors starting at SECTOR available for use.  They
+   may be allocated again once the journal has committed the
+   operations finished so far, and are marked free on disk by the
+   first free_map_commit() after that. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
-  ASSERT (bitmap_all (free_map, sector, cnt));
   lock_acquire(&free_map_lock);
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  release_pending (sector, cnt);
+  lock_release(&free_map_lock);
+}
+
+/* Releases each of the RUN_CNT runs of sectors in RUNS, as
+   free_map_release() would, but in a single update of the free
+   map. */
+void
+free_map_release_runs (const struct free_run *runs, size_t run_cnt)
+{
+  size_t i;
+
+  lock_acquire(&free_map_lock);
+  for (i = 0; i < run_cnt; i++)
+    release_pending (runs[i].start, runs[i].cnt);
+  lock_release(&free_map_lock);
+}
+
+/* Makes free_map_make_room() run HOOK, without the free map
+   locked.  HOOK may wait for sectors that are being released. */
+void
+free_map_on_full (void (*hook) (void))
+{
+  full_hook = hook;
+}
+
+/* Makes what room it can after an allocation found none.  Runs the
+   hook set by free_map_on_full(), and then, if sectors released so
+   far are still waiting for the journal, commits it so that they
+   can be allocated.  An allocation runs within an operation, which
+   must end before the journal can commit, so call this only after
+   ending it; within one it does nothing.  Returns true if sectors
+   were waiting, in which case the operation is worth trying
+   again. */
+bool
+free_map_make_room (void)
+{
+  bool waiting;
+
+  if (journal_active ())
+    return false;
+  if (full_hook != NULL)
+    full_hook ();
+  lock_acquire(&free_map_lock);
+  waiting = pending_cnt > 0;
   lock_release(&free_map_lock);
+  if (waiting)
+    journal_commit ();
+  return waiting;
+}
+
+/* Writes the sectors released since the last call to the free map
+   file.  Call only once everything that stopped referring to those
+   sectors has been committed to the journal.  Each sector of the
+   free map file is written by an operation of its own, so that
+   there is no limit to how many can be written. */
+void
+free_map_commit (void)
+{
+  size_t idx;
+
+  lock_acquire(&free_map_lock);
+  settle_pending ();
+  lock_release(&free_map_lock);
+  for (idx = 0; idx < bitmap_size (released); idx++)
+    {
+      journal_begin ();
+      lock_acquire(&free_map_lock);
+      if (bitmap_test (released, idx))
+        {
+          size_t first = idx * BITS_PER_SECTOR;
+          size_t cnt = bitmap_size (free_map) - first;
+          size_t i;
+
+          if (cnt > BITS_PER_SECTOR)
+            cnt = BITS_PER_SECTOR;
+          for (i = first; i < first + cnt; i++)
+            bitmap_set (disk_map, i, bitmap_test (free_map, i));
+          if (write_range (first, cnt))
+            bitmap_reset (released, idx);
+        }
+      lock_release(&free_map_lock);
+      journal_end ();
+    }
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -63,7 +326,8 @@ free_map_open (void)
   free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_read (free_map, free_map_file))
+  if (!bitmap_read (free_map, free_map_file)
+      || !bitmap_read (disk_map, free_map_file))
     PANIC ("can't read free map");
 }
 
@@ -71,22 +335,59 @@ free_map_open (void)
 void
 free_map_close (void)
 {
+  free_map_commit ();
   file_close (free_map_file);
 }
 
+/* Writes the free map to disk. */
+void
+free_map_sync (void)
+{
+  inode_sync (file_get_inode (free_map_file));
+}
+
 /* Creates a new free map file on disk and writes the free map to
    it. */
 void
 free_map_create (void)
 {
-  /* Create inode. */
-  if (!inode_create (FREE_MAP_SECTOR, bitmap_file_size (free_map)))
-    PANIC ("free map creation failed");
+  struct file *file;
+  size_t first;
 
-  /* Write bitmap to file. */
-  free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
-  if (free_map_file == NULL)
+  /* Create inode.  Its blocks are reserved up front, while
+     FREE_MAP_FILE is still null, since writing the free map cannot
+     itself allocate from the free map. */
+  journal_begin ();
+  if (!inode_create (FREE_MAP_SECTOR, 0, false))
+    PANIC ("free map creation failed");
+  file = file_open (inode_open (FREE_MAP_SECTOR));
+  if (file == NULL)
     PANIC ("can't open free map");
-  if (!bitmap_write (free_map, free_map_file))
+  if (!file_allocate (file, bitmap_file_size (free_map)))
+    PANIC ("free map creation failed");
+  journal_end ();
+
+  /* Write bitmap to file, a sector per operation. */
+  free_map_file = file;
+  for (first = 0; first < bitmap_size (disk_map); first += BITS_PER_SECTOR)
+    {
+      size_t cnt = bitmap_size (disk_map) - first;
+
+      if (cnt > BITS_PER_SECTOR)
+        cnt = BITS_PER_SECTOR;
+      journal_begin ();
+      if (!write_range (first, cnt))
+        PANIC ("can't write free map");
+      journal_end ();
+    }
+
+  /* bitmap_read() reads whole words, so pad out the last one. */
+  static const uint8_t zeros[16];
+  off_t length = file_length (file);
+  off_t pad = bitmap_file_size (disk_map) - length;
+  ASSERT (pad >= 0 && pad <= (off_t) sizeof zeros);
+  journal_begin ();
+  if (file_write_at (file, zeros, pad, length) != pad)
     PANIC ("can't write free map");
+  journal_end ();
 }
@@ -5,6 +5,13 @@
 #include <stddef.h>
 #include "devices/block.h"
 
+/* CNT consecutive sectors starting at START. */
+struct free_run
+  {
+    block_sector_t start;
+    size_t cnt;
+  };
+
 void free_map_init (void);
 void free_map_read (void);
 void free_map_create (void);
@@ -12,6 +19,13 @@ void free_map_open (void);
 void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (block_sector_t goal, size_t, block_sector_t *);
+size_t free_map_allocate_at (block_sector_t, size_t);
 void free_map_release (block_sector_t, size_t);
+void free_map_release_runs (const struct free_run *, size_t run_cnt);
+void free_map_on_full (void (*hook) (void));
+bool free_map_make_room (void);
+void free_map_commit (void);
+void free_map_sync (void);
 
 #endif /* filesys/free-map.h */
@@ -1,13 +1,17 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
+#include <stdlib.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
 #include "threads/malloc.h"
 #include "filesys/bufcache.h"
+#include "filesys/journal.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
@@ -15,238 +19,1302 @@
 #define NUM_DIRECT 123
 #define NUM_BLOCKS_IN_INDIRECT 128
 
+/* Blocks a block map can reach. */
+#define MAP_BLOCKS (NUM_DIRECT + NUM_BLOCKS_IN_INDIRECT \
+                    + NUM_BLOCKS_IN_INDIRECT * NUM_BLOCKS_IN_INDIRECT)
+
+/* Extents held in the inode itself and in its overflow block. */
+#define NUM_EXTENTS 61
+#define EXTENTS_PER_BLOCK 64
+#define MAX_EXTENTS (NUM_EXTENTS + EXTENTS_PER_BLOCK)
+
+/* Block pointer, or extent start, of a hole: a block that has no
+   sector yet and reads as zeros.  Block 0 holds the super block, so
+   it is never file data. */
+#define HOLE 0
+
+/* Bounds on the read-ahead window, in blocks. */
+#define RA_MIN_WINDOW 2
+#define RA_MAX_WINDOW 16
+
+/* How an inode records where its data lives. */
+enum inode_layout
+  {
+    LAYOUT_BLOCK_MAP,                   /* Direct and indirect sector pointers. */
+    LAYOUT_EXTENTS,                     /* Runs of consecutive sectors. */
+    LAYOUT_INLINE                       /* Data kept in the inode itself. */
+  };
+
+/* Most bytes of data a file can keep in its inode: the whole of the
+   space the block pointers would otherwise take. */
+#define INLINE_MAX ((NUM_DIRECT + 2) * sizeof (block_sector_t))
+
+/* A run of LEN consecutive sectors starting at START. */
+struct extent
+  {
+    block_sector_t start;
+    uint32_t len;
+  };
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.  It takes the first
+   sector of its block, whatever the cluster size. */
 struct inode_disk
   {
     off_t length;                       /* File size in bytes. */
-    uint32_t isdir;
-    block_sector_t direct_ptrs[NUM_DIRECT];
-    block_sector_t singly_indirect_ptr;
-    block_sector_t doubly_indirect_ptr;
+    uint8_t isdir;                      /* True if a directory. */
+    uint8_t layout;                     /* An enum inode_layout. */
+    uint16_t unused;
+    union
+      {
+        struct                          /* LAYOUT_BLOCK_MAP. */
+          {
+            block_sector_t direct_ptrs[NUM_DIRECT];
+            block_sector_t singly_indirect_ptr;
+            block_sector_t doubly_indirect_ptr;
+          };
+        struct                          /* LAYOUT_EXTENTS. */
+          {
+            uint32_t extent_cnt;        /* Extents in use, in file order. */
+            block_sector_t extent_block; /* Extents past NUM_EXTENTS. */
+            struct extent extents[NUM_EXTENTS];
+          };
+        uint8_t inline_data[INLINE_MAX]; /* LAYOUT_INLINE. */
+      };
     unsigned magic;                     /* Magic number. */
   };
 
-/* Returns the number of sectors to allocate for an inode SIZE
+/* Returns the number of blocks to allocate for an inode SIZE
    bytes long. */
 static inline size_t
 bytes_to_sectors (off_t size)
 {
-  return DIV_ROUND_UP (size, BLOCK_SECTOR_SIZE);
+  return DIV_ROUND_UP (size, FS_BLOCK_SIZE);
 }
 
+/* Block pointers decoded from a file's indirect blocks, kept so
+   that byte_to_sector() need not go through the buffer cache for
+   every sector.  Filled in lazily and discarded whenever the file
+   grows.  Allocated only for files that outgrow the direct blocks. */
+struct block_map
+  {
+    bool singly_valid;                  /* SINGLY has been loaded. */
+    bool doubly_valid;                  /* DOUBLY has been loaded. */
+    size_t inner_idx;                   /* Entry of DOUBLY held in INNER. */
+    block_sector_t singly[NUM_BLOCKS_IN_INDIRECT];
+    block_sector_t doubly[NUM_BLOCKS_IN_INDIRECT];
+    block_sector_t inner[NUM_BLOCKS_IN_INDIRECT];
+    bool overflow_valid;                /* OVERFLOW has been loaded. */
+    struct extent overflow[EXTENTS_PER_BLOCK];
+  };
+
+/* inner_idx value when INNER holds nothing. */
+#define NO_INNER ((size_t) -1)
+
 /* In-memory inode. */
 struct inode
   {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
+    struct list_elem closed_elem;       /* Element in closed_inodes or
+                                           reclaim_queue. */
+    struct list_elem dirty_elem;        /* Element in dirty_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
-    bool extending;
+    bool dirty;                         /* DATA changed since last stored? */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct lock inode_lock;
-    struct condition until_not_extending;
     struct condition until_no_writers;
+    struct list ranges;                 /* Byte ranges held, by range_acquire(). */
+    struct condition until_range_free;  /* Signaled when a range is released. */
+    size_t ra_next;                     /* Next block if reads are sequential. */
+    size_t ra_end;                      /* First block not yet read ahead. */
+    size_t ra_window;                   /* Blocks to keep read ahead. */
+    struct lock map_lock;               /* Protects MAP, block pointers and
+                                           inline data. */
+    struct block_map *map;              /* Decoded block pointers, or null. */
+    struct lock dir_lock;               /* Serializes directory updates. */
     struct inode_disk data;             /* Inode content. */
   };
 
+/* Indirect block.  Only its first sector is used, whatever the
+   cluster size. */
   struct indirect_block
   {
     block_sector_t blocks[NUM_BLOCKS_IN_INDIRECT];
   };
 
+/* Overflow block of an extent-layout inode. */
+struct extent_block
+  {
+    struct extent extents[EXTENTS_PER_BLOCK];
+  };
+
+/* Returns entry IDX of the indirect block in SECTOR, or HOLE if
+   SECTOR is itself a hole. */
+static block_sector_t
+indirect_lookup (block_sector_t sector, size_t idx)
+{
+  if (sector == HOLE)
+    return HOLE;
+
+  struct indirect_block *indirect = bufcache_get (fs_device, sector, BC_INDIRECT);
+  block_sector_t result = indirect->blocks[idx];
+  bufcache_put (fs_device, sector, false);
+  return result;
+}
+
+/* Returns the sector of block BLOCK_NUM of block-map INODE_DISK,
+   reading the indirect blocks through the buffer cache. */
+static block_sector_t
+block_map_sector (const struct inode_disk *inode_disk, size_t block_num)
+{
+  if (block_num < NUM_DIRECT)
+    return inode_disk->direct_ptrs[block_num];
+
+  block_num -= NUM_DIRECT;
+  if (block_num < NUM_BLOCKS_IN_INDIRECT)
+    return indirect_lookup (inode_disk->singly_indirect_ptr, block_num);
+
+  block_num -= NUM_BLOCKS_IN_INDIRECT;
+  block_sector_t indirect = indirect_lookup (inode_disk->doubly_indirect_ptr,
+                                             block_num / NUM_BLOCKS_IN_INDIRECT);
+  return indirect_lookup (indirect, block_num % NUM_BLOCKS_IN_INDIRECT);
+}
+
+/* Copies the entries of the indirect block in SECTOR to BLOCKS.
+   A hole in place of the indirect block maps only holes. */
+static void
+load_indirect (block_sector_t sector, block_sector_t blocks[])
+{
+  if (sector == HOLE)
+    {
+      memset (blocks, 0, NUM_BLOCKS_IN_INDIRECT * sizeof *blocks);
+      return;
+    }
+
+  struct indirect_block *indirect = bufcache_get (fs_device, sector, BC_INDIRECT);
+  memcpy (blocks, indirect->blocks, sizeof indirect->blocks);
+  bufcache_put (fs_device, sector, false);
+}
+
+/* Returns the sector of indirectly mapped block BLOCK_NUM, counted
+   from the first block past the direct ones, using and filling in
+   MAP.  Must be called with INODE's map_lock held. */
+static block_sector_t
+map_lookup (struct inode *inode, struct block_map *map, size_t block_num)
+{
+  if (block_num < NUM_BLOCKS_IN_INDIRECT)
+    {
+      if (!map->singly_valid)
+        {
+          load_indirect (inode->data.singly_indirect_ptr, map->singly);
+          map->singly_valid = true;
+        }
+      return map->singly[block_num];
+    }
+
+  block_num -= NUM_BLOCKS_IN_INDIRECT;
+  size_t outer = block_num / NUM_BLOCKS_IN_INDIRECT;
+  if (map->inner_idx != outer)
+    {
+      if (!map->doubly_valid)
+        {
+          load_indirect (inode->data.doubly_indirect_ptr, map->doubly);
+          map->doubly_valid = true;
+        }
+      load_indirect (map->doubly[outer], map->inner);
+      map->inner_idx = outer;
+    }
+  return map->inner[block_num % NUM_BLOCKS_IN_INDIRECT];
+}
+
+/* Marks everything in MAP as not loaded. */
+static void
+map_reset (struct block_map *map)
+{
+  map->singly_valid = false;
+  map->doubly_valid = false;
+  map->inner_idx = NO_INNER;
+  map->overflow_valid = false;
+}
+
+/* Returns INODE's block map, allocating it if necessary, or a null
+   pointer if memory is short.  Must be called with INODE's map_lock
+   held. */
+static struct block_map *
+map_get (struct inode *inode)
+{
+  if (inode->map == NULL)
+    {
+      inode->map = malloc (sizeof *inode->map);
+      if (inode->map != NULL)
+        map_reset (inode->map);
+    }
+  return inode->map;
+}
+
+/* Returns extent IDX of extent-layout INODE_DISK. */
+static struct extent
+extent_get (const struct inode_disk *inode_disk, size_t idx)
+{
+  if (idx < NUM_EXTENTS)
+    return inode_disk->extents[idx];
+
+  struct extent_block *block = bufcache_get (fs_device, inode_disk->extent_block,
+                                             BC_INDIRECT);
+  struct extent extent = block->extents[idx - NUM_EXTENTS];
+  bufcache_put (fs_device, inode_disk->extent_block, false);
+  return extent;
+}
+
+/* Sets extent IDX of extent-layout INODE_DISK to EXTENT. */
+static void
+extent_set (struct inode_disk *inode_disk, size_t idx, struct extent extent)
+{
+  if (idx < NUM_EXTENTS)
+    {
+      inode_disk->extents[idx] = extent;
+      return;
+    }
+
+  journal_add (inode_disk->extent_block, BC_INDIRECT);
+  struct extent_block *block = bufcache_get (fs_device, inode_disk->extent_block,
+                                             BC_INDIRECT);
+  block->extents[idx - NUM_EXTENTS] = extent;
+  bufcache_put (fs_device, inode_disk->extent_block, true);
+}
+
+/* Returns the sector that block BLOCK_NUM of extent EXTENT is in,
+   or HOLE if EXTENT is a hole. */
+static block_sector_t
+extent_block_sector (struct extent extent, size_t block_num)
+{
+  return extent.start == HOLE ? HOLE : extent.start + block_num;
+}
+
+/* Returns the sector holding block BLOCK_NUM of extent-layout
+   INODE, which must be within the file, or HOLE.  Extents in the
+   inode are scanned directly; those in the overflow block come from
+   INODE's block map.  Must be called with INODE's map_lock held. */
+static block_sector_t
+extent_to_sector (struct inode *inode, size_t block_num)
+{
+  const struct inode_disk *inode_disk = &inode->data;
+  size_t extent_cnt = inode_disk->extent_cnt;
+  block_sector_t sector = -1;
+  size_t i;
+
+  for (i = 0; i < extent_cnt && i < NUM_EXTENTS; i++)
+    {
+      if (block_num < inode_disk->extents[i].len)
+        return extent_block_sector (inode_disk->extents[i], block_num);
+      block_num -= inode_disk->extents[i].len;
+    }
+
+  struct block_map *map = map_get (inode);
+  const struct extent *overflow;
+  if (map != NULL)
+    {
+      if (!map->overflow_valid)
+        {
+          struct extent_block *block
+            = bufcache_get (fs_device, inode_disk->extent_block, BC_INDIRECT);
+          memcpy (map->overflow, block->extents, sizeof map->overflow);
+          bufcache_put (fs_device, inode_disk->extent_block, false);
+          map->overflow_valid = true;
+        }
+      overflow = map->overflow;
+    }
+  else
+    overflow = ((struct extent_block *)
+                bufcache_get (fs_device, inode_disk->extent_block, BC_INDIRECT))->extents;
+
+  for (i = 0; i + NUM_EXTENTS < extent_cnt; i++)
+    {
+      if (block_num < overflow[i].len)
+        {
+          sector = extent_block_sector (overflow[i], block_num);
+          break;
+        }
+      block_num -= overflow[i].len;
+    }
+
+  if (map == NULL)
+    bufcache_put (fs_device, inode_disk->extent_block, false);
+  return sector;
+}
+
+/* Returns the sector of block BLOCK_NUM of INODE, or HOLE if it is
+   a hole, whether or not it lies within the file's length.  The
+   caller must hold INODE's map_lock. */
+static block_sector_t
+block_to_sector (struct inode *inode, size_t block_num)
+{
+  ASSERT (lock_held_by_current_thread (&inode->map_lock));
+  if (inode->data.layout == LAYOUT_INLINE)
+    return HOLE;
+  else if (inode->data.layout == LAYOUT_EXTENTS)
+    return extent_to_sector (inode, block_num);
+  else if (block_num < NUM_DIRECT)
+    return inode->data.direct_ptrs[block_num];
+  else
+    {
+      struct block_map *map = map_get (inode);
+      if (map != NULL)
+        return map_lookup (inode, map, block_num - NUM_DIRECT);
+      else
+        return block_map_sector (&inode->data, block_num);
+    }
+}
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
+   within INODE, or HOLE if that byte is in a hole.
    Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   POS.  An inline file has no sectors, so all of it reads as a
+   hole here. */
 static block_sector_t
-byte_to_sector (struct inode_disk *inode_disk, off_t pos)
+byte_to_sector (struct inode *inode, off_t pos)
 {
-  ASSERT (inode_disk != NULL);
-    if (pos < inode_disk->length) {
-      int block_num = pos / BLOCK_SECTOR_SIZE;
-      if (block_num < NUM_DIRECT) {
-        return inode_disk->direct_ptrs[block_num];
-      }
+  ASSERT (inode != NULL);
+  if (pos >= inode->data.length)
+    return -1;
 
-      else if (block_num < NUM_DIRECT + NUM_BLOCKS_IN_INDIRECT) {
-        struct indirect_block indirect;
-        bufcache_read(fs_device, inode_disk->singly_indirect_ptr, &indirect, 0, BLOCK_SECTOR_SIZE);
-        block_num -= NUM_DIRECT;
-        return indirect.blocks[block_num];
-      }
+  /* Filling a hole can move extents around, or even change the
+     layout, so the pointers are read under map_lock. */
+  block_sector_t sector;
+  lock_acquire (&inode->map_lock);
+  sector = block_to_sector (inode, pos / FS_BLOCK_SIZE);
+  lock_release (&inode->map_lock);
+  return sector;
+}
 
-      else {
-        struct indirect_block doubly_indirect;
-        bufcache_read(fs_device, inode_disk->doubly_indirect_ptr, &doubly_indirect, 0, BLOCK_SECTOR_SIZE);
-        block_num -= (NUM_DIRECT + NUM_BLOCKS_IN_INDIRECT);
-        int indirect_block_num = block_num / NUM_BLOCKS_IN_INDIRECT;
-        struct indirect_block indirect;
-        bufcache_read(fs_device, doubly_indirect.blocks[indirect_block_num], &indirect, 0, BLOCK_SECTOR_SIZE);
-        block_num = block_num % BLOCK_SECTOR_SIZE;
-        return indirect.blocks[block_num];
-      }
+/* Allocates an indirect block as near to GOAL as possible, with
+   every entry zeroed, and stores its sector in *SECTORP.  Returns
+   false if the disk is full. */
+static bool
+allocate_indirect (block_sector_t *sectorp, block_sector_t goal)
+{
+  if (!free_map_allocate_near (goal, 1, sectorp))
+    return false;
+  journal_add (*sectorp, BC_INDIRECT);
+  memset (bufcache_get (fs_device, *sectorp, BC_INDIRECT), 0, FS_BLOCK_SIZE);
+  bufcache_put (fs_device, *sectorp, true);
+  return true;
+}
+
+/* Most indirect blocks one fill of a block map can allocate: the
+   singly and doubly indirect blocks and every leaf of the latter. */
+#define FRESH_MAX (2 + NUM_BLOCKS_IN_INDIRECT)
+
+/* Indirect blocks allocated by one fill of a block map.  Nothing on
+   disk refers to them until the inode that does is stored, or an
+   indirect block already in use, which is logged, is changed to.
+   So instead of being logged themselves, which could take more of
+   the log than one operation may, they are written to disk by
+   fresh_flush() before the fill returns. */
+struct fresh_blocks
+  {
+    block_sector_t sectors[FRESH_MAX];
+    size_t cnt;
+  };
+
+/* Most sectors that storing one pointer in a block map can log: the
+   free map sectors for the data block, a new doubly indirect block
+   and a new leaf, or fewer of those and the indirect blocks in use
+   that gain a pointer. */
+#define STORE_LOG_MAX 3
+
+/* Returns true if SECTOR is one of the blocks in FRESH. */
+static bool
+is_fresh (const struct fresh_blocks *fresh, block_sector_t sector)
+{
+  for (size_t i = 0; i < fresh->cnt; i++)
+    if (fresh->sectors[i] == sector)
+      return true;
+  return false;
+}
+
+/* Writes the blocks in FRESH to disk and forgets them. */
+static void
+fresh_flush (struct fresh_blocks *fresh)
+{
+  bufcache_flush_sectors (fs_device, fresh->sectors, fresh->cnt);
+  fresh->cnt = 0;
+}
+
+/* Allocates an indirect block for a block map near GOAL, with every
+   entry zeroed, stores its sector in *SECTORP and adds it to FRESH.
+   Returns false if the disk is full. */
+static bool
+allocate_fresh (struct fresh_blocks *fresh, block_sector_t *sectorp,
+                block_sector_t goal)
+{
+  ASSERT (fresh->cnt < FRESH_MAX);
+  if (journal_room () == 0 || !free_map_allocate_near (goal, 1, sectorp))
+    return false;
+  memset (bufcache_get (fs_device, *sectorp, BC_INDIRECT), 0, FS_BLOCK_SIZE);
+  bufcache_put (fs_device, *sectorp, true);
+  fresh->sectors[fresh->cnt++] = *sectorp;
+  return true;
+}
 
-    } else {
-      return -1;
+/* Stores SECTOR as entry IDX of the indirect block in *INDIRECTP,
+   first allocating the indirect block, next to SECTOR if possible,
+   if it is a hole.  The indirect block is logged unless it is in
+   FRESH. */
+static bool
+indirect_store (struct fresh_blocks *fresh, block_sector_t *indirectp,
+                size_t idx, block_sector_t sector)
+{
+  if (*indirectp == HOLE && !allocate_fresh (fresh, indirectp, sector + 1))
+    return false;
+
+  if (!is_fresh (fresh, *indirectp))
+    journal_add (*indirectp, BC_INDIRECT);
+  struct indirect_block *indirect = bufcache_get (fs_device, *indirectp, BC_INDIRECT);
+  indirect->blocks[idx] = sector;
+  bufcache_put (fs_device, *indirectp, true);
+  return true;
+}
+
+/* Stores SECTOR as the pointer for block BLOCK_NUM of block-map
+   INODE_DISK, which must be a hole, allocating any indirect blocks
+   needed to reach it and adding them to FRESH.  Returns false if
+   the disk is full. */
+static bool
+block_map_store (struct fresh_blocks *fresh, struct inode_disk *inode_disk,
+                 size_t block_num, block_sector_t sector)
+{
+  bool success;
+
+  if (block_num < NUM_DIRECT)
+    {
+      inode_disk->direct_ptrs[block_num] = sector;
+      return true;
+    }
+
+  block_num -= NUM_DIRECT;
+  if (block_num < NUM_BLOCKS_IN_INDIRECT)
+    success = indirect_store (fresh, &inode_disk->singly_indirect_ptr,
+                              block_num, sector);
+  else
+    {
+      block_num -= NUM_BLOCKS_IN_INDIRECT;
+      size_t outer = block_num / NUM_BLOCKS_IN_INDIRECT;
+      size_t inner = block_num % NUM_BLOCKS_IN_INDIRECT;
+
+      success = inode_disk->doubly_indirect_ptr != HOLE
+                || allocate_fresh (fresh, &inode_disk->doubly_indirect_ptr,
+                                   sector + 1);
+      if (success)
+        {
+          if (!is_fresh (fresh, inode_disk->doubly_indirect_ptr))
+            journal_add (inode_disk->doubly_indirect_ptr, BC_INDIRECT);
+          struct indirect_block *doubly_indirect
+            = bufcache_get (fs_device, inode_disk->doubly_indirect_ptr, BC_INDIRECT);
+          bool was_hole = doubly_indirect->blocks[outer] == HOLE;
+          success = indirect_store (fresh, &doubly_indirect->blocks[outer],
+                                    inner, sector);
+          bufcache_put (fs_device, inode_disk->doubly_indirect_ptr,
+                        was_hole && success);
+        }
     }
+  return success;
 }
 
-static bool allocate_file(struct inode *inode, struct inode_disk *inode_disk, off_t length) {
-  size_t num_sectors = bytes_to_sectors(length);
+/* Allocates a data sector for block BLOCK_NUM of INODE_DISK, which
+   must be a hole, as near to *GOAL as possible, along with any
+   indirect blocks needed to reach it, which are added to FRESH, and
+   advances *GOAL past it. */
+static bool
+allocate_block (struct fresh_blocks *fresh, struct inode_disk *inode_disk,
+                size_t block_num, block_sector_t *goal)
+{
   block_sector_t sector;
-  size_t count;
-  size_t block_num = 0;
 
-  if (inode != NULL) {
-    inode->extending = true;
-    lock_release(&inode->inode_lock);
-  }
+  if (!free_map_allocate_near (*goal, 1, &sector))
+    return false;
+  *goal = sector + 1;
 
-  for (count = 0; count < NUM_DIRECT && count < num_sectors; count++) {
-    if (byte_to_sector(inode_disk, block_num * BLOCK_SECTOR_SIZE) == -1) {
-      if (!free_map_allocate(1, &sector)) {
-        //deal with failure
-        return false;
-      }
-      inode_disk->direct_ptrs[count] = sector;
+  if (!block_map_store (fresh, inode_disk, block_num, sector))
+    {
+      free_map_release (sector, 1);
+      return false;
     }
-    block_num++;
-  }
-  num_sectors -= count;
+  return true;
+}
 
-  if (num_sectors > 0) {
-    if (byte_to_sector(inode_disk, block_num * BLOCK_SECTOR_SIZE) == -1) {
-      if (!free_map_allocate(1, &sector)) {
-        // deal with failure
-        return false;
-      }
-      inode_disk->singly_indirect_ptr = sector;
-    }
-    struct indirect_block indirect;
-    bufcache_read(fs_device, inode_disk->singly_indirect_ptr, &indirect, 0, BLOCK_SECTOR_SIZE);
-    for (count = 0; count < NUM_BLOCKS_IN_INDIRECT && count < num_sectors; count++) {
-      if (byte_to_sector(inode_disk, block_num * BLOCK_SECTOR_SIZE) == -1) {
-        if (!free_map_allocate(1, &sector)) {
-          //deal with failure
-          return false;
+/* Returns the number of blocks mapped by extent-layout INODE_DISK,
+   holes included.  This may exceed the sectors its length calls
+   for, if an earlier extension failed part way. */
+static size_t
+extent_sectors (const struct inode_disk *inode_disk)
+{
+  size_t total = 0;
+  for (size_t i = 0; i < inode_disk->extent_cnt; i++)
+    total += extent_get (inode_disk, i).len;
+  return total;
+}
+
+/* Makes room in extent-layout INODE_DISK for CNT more extents,
+   allocating its overflow block near GOAL if they need it.  Returns
+   false if there is no room. */
+static bool
+extent_reserve (struct inode_disk *inode_disk, size_t cnt, block_sector_t goal)
+{
+  size_t extent_cnt = inode_disk->extent_cnt;
+
+  if (extent_cnt + cnt > MAX_EXTENTS)
+    return false;
+  return (extent_cnt > NUM_EXTENTS || extent_cnt + cnt <= NUM_EXTENTS
+          || allocate_indirect (&inode_disk->extent_block, goal));
+}
+
+/* Inserts EXTENT as extent IDX of INODE_DISK, moving those from IDX
+   on up by one.  extent_reserve() must have made room for it. */
+static void
+extent_insert (struct inode_disk *inode_disk, size_t idx, struct extent extent)
+{
+  size_t i;
+
+  for (i = inode_disk->extent_cnt; i > idx; i--)
+    extent_set (inode_disk, i, extent_get (inode_disk, i - 1));
+  extent_set (inode_disk, idx, extent);
+  inode_disk->extent_cnt++;
+}
+
+/* Removes extent IDX of INODE_DISK, moving those after it down by
+   one, and releases the overflow block once it is no longer
+   needed. */
+static void
+extent_remove (struct inode_disk *inode_disk, size_t idx)
+{
+  size_t i;
+
+  for (i = idx; i + 1 < inode_disk->extent_cnt; i++)
+    extent_set (inode_disk, i, extent_get (inode_disk, i + 1));
+  if (--inode_disk->extent_cnt == NUM_EXTENTS)
+    free_map_release (inode_disk->extent_block, 1);
+}
+
+/* Returns the index of the extent of INODE_DISK that holds block
+   BLOCK_NUM, and stores the block's offset within it in *OFSP.
+   Returns the extent count if BLOCK_NUM is past every extent. */
+static size_t
+extent_find (const struct inode_disk *inode_disk, size_t block_num,
+             size_t *ofsp)
+{
+  size_t i;
+
+  for (i = 0; i < inode_disk->extent_cnt; i++)
+    {
+      struct extent extent = extent_get (inode_disk, i);
+      if (block_num < extent.len)
+        break;
+      block_num -= extent.len;
+    }
+  *ofsp = block_num;
+  return i;
+}
+
+/* Appends the CNT sectors starting at START, or a hole CNT blocks
+   long if START is HOLE, to extent-layout INODE_DISK, lengthening
+   the last extent if the run follows on from it.  Returns false if
+   INODE_DISK has no room for another extent. */
+static bool
+extent_append (struct inode_disk *inode_disk, block_sector_t start, size_t cnt)
+{
+  size_t extent_cnt = inode_disk->extent_cnt;
+
+  if (extent_cnt > 0)
+    {
+      struct extent last = extent_get (inode_disk, extent_cnt - 1);
+      if (start == HOLE
+          ? last.start == HOLE
+          : last.start != HOLE && last.start + last.len == start)
+        {
+          last.len += cnt;
+          extent_set (inode_disk, extent_cnt - 1, last);
+          return true;
         }
-        indirect.blocks[count] = sector;
-      }
-      block_num++;
     }
-    bufcache_write(fs_device, inode_disk->singly_indirect_ptr, &indirect, 0, BLOCK_SECTOR_SIZE);
-    num_sectors -= count;
-  }
 
-  if (num_sectors > 0) {
-    if (byte_to_sector(inode_disk, block_num * BLOCK_SECTOR_SIZE) == -1) {
-      if (!free_map_allocate(1, &sector)) {
-        // deal with failure
+  if (!extent_reserve (inode_disk, 1, start + cnt))
+    return false;
+  extent_set (inode_disk, extent_cnt, (struct extent) {start, cnt});
+  inode_disk->extent_cnt++;
+  return true;
+}
+
+static void mark_dirty (struct inode *);
+static void release_extents (struct inode_disk *);
+
+/* Makes the first LENGTH bytes of new INODE_DISK a hole, so that
+   its blocks are only allocated, next to the inode, when first
+   written, and read as zeros until then.  Returns false if LENGTH
+   is too long for INODE_DISK's layout. */
+static bool create_holes(struct inode_disk *inode_disk, off_t length) {
+  size_t num_sectors = bytes_to_sectors(length);
+
+  if (inode_disk->layout == LAYOUT_EXTENTS && num_sectors > 0)
+    return extent_append(inode_disk, HOLE, num_sectors);
+  if (inode_disk->layout == LAYOUT_BLOCK_MAP)
+    return num_sectors <= MAP_BLOCKS;
+  return true;
+}
+
+/* Returns true if a write of bytes OFFSET up to END leaves part of
+   block BLOCK_NUM as it was. */
+static bool
+partly_written (size_t block_num, off_t offset, off_t end)
+{
+  off_t block_start = (off_t) block_num * FS_BLOCK_SIZE;
+  return offset > block_start || end < block_start + FS_BLOCK_SIZE;
+}
+
+/* Returns the buffer cache class of the data blocks of
+   INODE_DISK.  A directory's blocks are metadata to the cache. */
+static enum bufcache_class
+data_class (const struct inode_disk *inode_disk)
+{
+  return inode_disk->isdir ? BC_DIR : BC_DATA;
+}
+
+/* Zeroes the newly allocated data block in SECTOR, which is block
+   BLOCK_NUM of a file whose blocks are of class CLS, unless a write
+   of bytes OFFSET up to END is about to replace all of it. */
+static void
+prepare_block (block_sector_t sector, size_t block_num, off_t offset, off_t end,
+               enum bufcache_class cls)
+{
+  if (partly_written (block_num, offset, end))
+    {
+      memset (bufcache_get (fs_device, sector, cls), 0, FS_BLOCK_SIZE);
+      bufcache_put (fs_device, sector, true);
+    }
+}
+
+/* Gives each hole among the blocks of block-map INODE_DISK, whose
+   inode is in INODE_SECTOR, that bytes OFFSET up to END fall in a
+   sector of its own.  Sets *CHANGED to true if any hole was
+   filled.  Stops short, returning false, if the disk is full or the
+   running operation has logged as much as it may. */
+static bool
+fill_block_map (struct inode_disk *inode_disk, block_sector_t inode_sector,
+                off_t offset, off_t end, bool *changed)
+{
+  size_t block_num = offset / FS_BLOCK_SIZE;
+  size_t end_block = DIV_ROUND_UP (end, FS_BLOCK_SIZE);
+  block_sector_t goal = inode_sector + 1;
+  struct fresh_blocks *fresh;
+  bool success = true;
+
+  if (end_block > MAP_BLOCKS)
+    return false;
+  fresh = malloc (sizeof *fresh);
+  if (fresh == NULL)
+    return false;
+  fresh->cnt = 0;
+  if (block_num > 0 && block_map_sector (inode_disk, block_num - 1) != HOLE)
+    goal = block_map_sector (inode_disk, block_num - 1) + 1;
+
+  for (; block_num < end_block; block_num++)
+    {
+      block_sector_t sector = block_map_sector (inode_disk, block_num);
+      if (sector != HOLE)
+        {
+          goal = sector + 1;
+          continue;
+        }
+      if (journal_room () < STORE_LOG_MAX
+          || !allocate_block (fresh, inode_disk, block_num, &goal))
+        {
+          success = false;
+          break;
+        }
+      *changed = true;
+      prepare_block (goal - 1, block_num, offset, end,
+                     data_class (inode_disk));
+    }
+  fresh_flush (fresh);
+  free (fresh);
+  return success;
+}
+
+/* Gives each hole among the blocks of extent-layout INODE_DISK,
+   whose inode is in INODE_SECTOR, that bytes OFFSET up to END fall
+   in sectors of its own, first extending the extents with a hole
+   if they stop short of END.  A hole filled from its start is added
+   to the extent before it if the sectors that follow that extent
+   are free; otherwise the hole is split around a new extent.  Sets
+   *CHANGED to true if the extents were changed. */
+static bool
+fill_extents (struct inode_disk *inode_disk, block_sector_t inode_sector,
+              off_t offset, off_t end, bool *changed)
+{
+  size_t block_num = offset / FS_BLOCK_SIZE;
+  size_t end_block = DIV_ROUND_UP (end, FS_BLOCK_SIZE);
+  size_t have = extent_sectors (inode_disk);
+
+  if (have < end_block)
+    {
+      if (!extent_append (inode_disk, HOLE, end_block - have))
         return false;
-      }
-      inode_disk->doubly_indirect_ptr = sector;
+      *changed = true;
+    }
+
+  while (block_num < end_block)
+    {
+      size_t ofs;
+      size_t idx = extent_find (inode_disk, block_num, &ofs);
+      struct extent hole = extent_get (inode_disk, idx);
+      struct extent prev = {HOLE, 0};
+      block_sector_t goal = inode_sector + 1;
+      block_sector_t start = HOLE;
+      size_t want, got = 0, after, i;
+
+      ASSERT (idx < inode_disk->extent_cnt);
+      if (hole.start != HOLE)
+        {
+          block_num += hole.len - ofs;
+          continue;
+        }
+
+      want = hole.len - ofs;
+      if (want > end_block - block_num)
+        want = end_block - block_num;
+      if (idx > 0)
+        prev = extent_get (inode_disk, idx - 1);
+      if (prev.start != HOLE)
+        goal = prev.start + prev.len;
+
+      if (ofs == 0 && prev.start != HOLE)
+        {
+          got = free_map_allocate_at (goal, want);
+          start = goal;
+        }
+      if (got > 0)
+        {
+          prev.len += got;
+          extent_set (inode_disk, idx - 1, prev);
+          hole.len -= got;
+          if (hole.len > 0)
+            extent_set (inode_disk, idx, hole);
+          else
+            extent_remove (inode_disk, idx);
+        }
+      else
+        {
+          for (got = want; !free_map_allocate_near (goal, got, &start); got /= 2)
+            if (got == 1)
+              return false;
+          after = hole.len - ofs - got;
+          if (!extent_reserve (inode_disk, (ofs > 0) + (after > 0), start + got))
+            {
+              free_map_release (start, got);
+              return false;
+            }
+          if (ofs > 0)
+            {
+              hole.len = ofs;
+              extent_set (inode_disk, idx++, hole);
+              extent_insert (inode_disk, idx, (struct extent) {start, got});
+            }
+          else
+            extent_set (inode_disk, idx, (struct extent) {start, got});
+          if (after > 0)
+            extent_insert (inode_disk, idx + 1, (struct extent) {HOLE, after});
+        }
+      *changed = true;
+
+      for (i = 0; i < got; i++)
+        prepare_block (start + i, block_num + i, offset, end,
+                       data_class (inode_disk));
+      block_num += got;
+    }
+  return true;
+}
+
+/* Releases the indirect blocks of block-map INODE_DISK, but not the
+   data blocks they point to. */
+static void
+release_map_indirect (const struct inode_disk *inode_disk)
+{
+  if (inode_disk->doubly_indirect_ptr != HOLE)
+    {
+      struct indirect_block *doubly_indirect
+        = bufcache_get (fs_device, inode_disk->doubly_indirect_ptr, BC_INDIRECT);
+      for (size_t i = 0; i < NUM_BLOCKS_IN_INDIRECT; i++)
+        if (doubly_indirect->blocks[i] != HOLE)
+          free_map_release (doubly_indirect->blocks[i], 1);
+      bufcache_put (fs_device, inode_disk->doubly_indirect_ptr, false);
+      free_map_release (inode_disk->doubly_indirect_ptr, 1);
     }
+  if (inode_disk->singly_indirect_ptr != HOLE)
+    free_map_release (inode_disk->singly_indirect_ptr, 1);
+}
 
-    struct indirect_block doubly_indirect;
-    bufcache_read(fs_device, inode_disk->doubly_indirect_ptr, &doubly_indirect, 0, BLOCK_SECTOR_SIZE);
-    int num_indirect_blocks = DIV_ROUND_UP (num_sectors, BLOCK_SECTOR_SIZE);
-    for (int i = 0; i < num_indirect_blocks; i++) {
-      if (byte_to_sector(inode_disk, block_num * BLOCK_SECTOR_SIZE) == -1) {
-        if (!free_map_allocate(1, &sector)) {
-          // deal with failure
+/* Rewrites extent-layout INODE_DISK as a block map, keeping every
+   block where it is.  This is for a file that holes have broken
+   into more extents than an inode can hold.  Blocks reserved past
+   end of file by inode_allocate() are released instead, since a
+   block map keeps none.  Returns false, leaving INODE_DISK as it
+   was, if the file is too long for a block map, the disk or memory
+   is full, or allocating the indirect blocks would log more than
+   the running operation may. */
+static bool
+extents_to_block_map (struct inode_disk *inode_disk)
+{
+  struct inode_disk *map_disk;
+  struct fresh_blocks *fresh;
+  size_t keep = bytes_to_sectors (inode_disk->length);
+  size_t block_num = 0;
+  bool success = true;
+
+  if (keep > MAP_BLOCKS)
+    return false;
+  map_disk = calloc (1, sizeof *map_disk);
+  fresh = malloc (sizeof *fresh);
+  if (map_disk == NULL || fresh == NULL)
+    {
+      free (map_disk);
+      free (fresh);
+      return false;
+    }
+  fresh->cnt = 0;
+  map_disk->length = inode_disk->length;
+  map_disk->isdir = inode_disk->isdir;
+  map_disk->layout = LAYOUT_BLOCK_MAP;
+  map_disk->magic = inode_disk->magic;
+
+  for (size_t i = 0; success && i < inode_disk->extent_cnt; i++)
+    {
+      struct extent extent = extent_get (inode_disk, i);
+      for (size_t j = 0; success && j < extent.len; j++, block_num++)
+        if (extent.start != HOLE && block_num < keep)
+          success = block_map_store (fresh, map_disk, block_num,
+                                     extent.start + j);
+    }
+
+  if (success)
+    {
+      block_num = 0;
+      for (size_t i = 0; i < inode_disk->extent_cnt; i++)
+        {
+          struct extent extent = extent_get (inode_disk, i);
+          if (extent.start != HOLE && block_num + extent.len > keep)
+            {
+              size_t skip = block_num < keep ? keep - block_num : 0;
+              free_map_release (extent.start + skip, extent.len - skip);
+            }
+          block_num += extent.len;
+        }
+      if (inode_disk->extent_cnt > NUM_EXTENTS)
+        free_map_release (inode_disk->extent_block, 1);
+      memcpy (inode_disk, map_disk, sizeof *map_disk);
+      fresh_flush (fresh);
+    }
+  else
+    release_map_indirect (map_disk);
+  free (fresh);
+  free (map_disk);
+  return success;
+}
+
+/* Moves the data of inline INODE out to a block of its own, making
+   it an extent-layout file that can grow past INLINE_MAX bytes.
+   The caller must hold INODE's map_lock.  Returns true if
+   successful; on failure INODE is left as it was. */
+static bool
+inline_to_extents (struct inode *inode)
+{
+  struct inode_disk *disk = &inode->data;
+  off_t length = disk->length;
+  bool changed = false;
+  uint8_t *data;
+
+  ASSERT (disk->layout == LAYOUT_INLINE);
+  data = malloc (INLINE_MAX);
+  if (data == NULL)
+    return false;
+  memcpy (data, disk->inline_data, INLINE_MAX);
+  memset (disk->inline_data, 0, INLINE_MAX);
+  disk->layout = LAYOUT_EXTENTS;
+
+  if (length > 0)
+    {
+      if (!fill_extents (disk, inode->sector, 0, length, &changed))
+        {
+          release_extents (disk);
+          memcpy (disk->inline_data, data, INLINE_MAX);
+          disk->layout = LAYOUT_INLINE;
+          free (data);
           return false;
         }
-        doubly_indirect.blocks[i] = sector;
-      }
+      bufcache_write (fs_device, disk->extents[0].start, data, 0, length,
+                      data_class (disk));
+    }
+  free (data);
 
-      struct indirect_block indirect;
-      bufcache_read(fs_device, doubly_indirect.blocks[i], &indirect, 0, BLOCK_SECTOR_SIZE);
-      for (count = 0; count < NUM_BLOCKS_IN_INDIRECT && count < num_sectors; count++) {
-        if (byte_to_sector(inode_disk, block_num * BLOCK_SECTOR_SIZE) == -1) {
-          if (!free_map_allocate(1, &sector)) {
-            //deal with failure
-            return false;
-          }
-          indirect.blocks[count] = sector;
+  lock_acquire (&inode->inode_lock);
+  mark_dirty (inode);
+  lock_release (&inode->inode_lock);
+  return true;
+}
+
+/* Copies SIZE bytes at OFFSET in INODE into BUFFER if INODE keeps
+   its data inline.  Returns false, copying nothing, if it does
+   not. */
+static bool
+read_inline (struct inode *inode, void *buffer, off_t size, off_t offset)
+{
+  bool is_inline;
+
+  lock_acquire (&inode->map_lock);
+  is_inline = inode->data.layout == LAYOUT_INLINE;
+  if (is_inline)
+    memcpy (buffer, inode->data.inline_data + offset, size);
+  lock_release (&inode->map_lock);
+  return is_inline;
+}
+
+/* Writes SIZE bytes from BUFFER at OFFSET in INODE if INODE keeps
+   its data inline and still can afterward, extending it if need
+   be.  If the write would take INODE past INLINE_MAX bytes, its
+   data is moved out to a block first and left for the caller to
+   write as usual.  Returns the number of bytes written, or -1 if
+   the caller is to write them. */
+static off_t
+write_inline (struct inode *inode, const void *buffer, off_t size,
+              off_t offset)
+{
+  off_t written = -1;
+
+  lock_acquire (&inode->map_lock);
+  if (inode->data.layout != LAYOUT_INLINE)
+    ;
+  else if (offset + size <= (off_t) INLINE_MAX)
+    {
+      memcpy (inode->data.inline_data + offset, buffer, size);
+      written = size;
+
+      lock_acquire (&inode->inode_lock);
+      if (offset + size > inode->data.length)
+        inode->data.length = offset + size;
+      mark_dirty (inode);
+      lock_release (&inode->inode_lock);
+    }
+  else if (!inline_to_extents (inode))
+    written = 0;
+  lock_release (&inode->map_lock);
+  return written;
+}
+
+/* Makes sure that every block a write of SIZE bytes at OFFSET
+   touches in INODE has a sector, allocating sectors for holes and
+   for blocks past the end of the file.  This is the only way a file
+   gains blocks once created, so a block is allocated the first time
+   it is written, and a hole left by seeking past the end costs
+   nothing.  Returns the offset up to which the write's blocks all
+   have sectors: OFFSET + SIZE if successful, less if the disk filled
+   up or the operation's share of the log ran out.  Blocks are filled
+   in order, so none past that point was given a sector. */
+static off_t
+fill_blocks (struct inode *inode, off_t offset, off_t size)
+{
+  bool changed = false;
+  bool success;
+  off_t filled = offset + size;
+
+  lock_acquire (&inode->map_lock);
+  ASSERT (inode->data.layout != LAYOUT_INLINE);
+  if (inode->data.layout == LAYOUT_EXTENTS)
+    {
+      success = fill_extents (&inode->data, inode->sector, offset, offset + size,
+                              &changed);
+
+      /* A file with holes filled here and there can run out of
+         extents.  It carries on with a block map instead. */
+      if (!success && inode->data.extent_cnt + 2 > MAX_EXTENTS
+          && extents_to_block_map (&inode->data))
+        {
+          changed = true;
+          success = fill_block_map (&inode->data, inode->sector, offset,
+                                    offset + size, &changed);
         }
+    }
+  else
+    success = fill_block_map (&inode->data, inode->sector, offset, offset + size,
+                              &changed);
+  if (changed && inode->map != NULL)
+    map_reset (inode->map);
+  if (!success)
+    {
+      size_t block_num = offset / FS_BLOCK_SIZE;
+      block_sector_t sector;
+
+      while ((off_t) block_num * FS_BLOCK_SIZE < offset + size
+             && (sector = block_to_sector (inode, block_num)) != HOLE
+             && sector != (block_sector_t) -1)
         block_num++;
-      }
-      bufcache_write(fs_device, doubly_indirect.blocks[i], &indirect, 0, BLOCK_SECTOR_SIZE);
-      num_sectors -= count;
+      filled = (off_t) block_num * FS_BLOCK_SIZE;
+      if (filled < offset)
+        filled = offset;
     }
-    bufcache_write(fs_device, inode_disk->doubly_indirect_ptr, &doubly_indirect, 0, BLOCK_SECTOR_SIZE);
-  }
+  lock_release (&inode->map_lock);
 
-  if (inode != NULL) {
-    lock_acquire(&inode->inode_lock);
-    inode_disk->length = length;
-    inode->extending = false;
-    cond_broadcast(&inode->until_not_extending, &inode->inode_lock);
-    lock_release(&inode->inode_lock);
-  }
+  if (changed)
+    {
+      lock_acquire (&inode->inode_lock);
+      mark_dirty (inode);
+      lock_release (&inode->inode_lock);
+    }
+  return filled;
+}
 
-  return true;
+/* Releases every extent of extent-layout INODE_DISK, and its
+   overflow block. */
+static void
+release_extents (struct inode_disk *inode_disk)
+{
+  for (size_t i = 0; i < inode_disk->extent_cnt; i++)
+    {
+      struct extent extent = extent_get (inode_disk, i);
+      if (extent.start != HOLE)
+        free_map_release (extent.start, extent.len);
+    }
+  if (inode_disk->extent_cnt > NUM_EXTENTS)
+    free_map_release (inode_disk->extent_block, 1);
 }
 
+/* Zeroes bytes FROM up to TO of INODE, which lie past its end of
+   file, wherever they fall in blocks reserved by inode_allocate().
+   Such blocks hold whatever was last on disk until they are
+   written, and a write past the end is about to bring these bytes
+   into the file.  Only extent-layout files have reserved blocks. */
+static void
+zero_reserved (struct inode *inode, off_t from, off_t to)
+{
+  static char zeros[FS_CLUSTER_MAX * BLOCK_SECTOR_SIZE];
 
-static bool deallocate_file(struct inode *inode) {
-  size_t num_sectors = bytes_to_sectors(inode->data.length);
-  size_t count;
-  for (count = 0; count < NUM_DIRECT && count < num_sectors; count++) {
-    free_map_release (inode->data.direct_ptrs[count], 1);
-  }
-  num_sectors -= count;
+  lock_acquire (&inode->map_lock);
+  if (inode->data.layout == LAYOUT_EXTENTS)
+    {
+      size_t mapped = extent_sectors (&inode->data);
+      while (from < to && (size_t) from / FS_BLOCK_SIZE < mapped)
+        {
+          int sector_ofs = from % FS_BLOCK_SIZE;
+          off_t chunk = FS_BLOCK_SIZE - sector_ofs;
+          block_sector_t sector;
 
-  if (num_sectors > 0) {
-    struct indirect_block indirect;
-    bufcache_read(fs_device, inode->data.singly_indirect_ptr, &indirect, 0, BLOCK_SECTOR_SIZE);
-    for (count = 0; count < NUM_BLOCKS_IN_INDIRECT && count < num_sectors; count++) {
-      free_map_release (indirect.blocks[count], 1);
+          if (chunk > to - from)
+            chunk = to - from;
+          sector = extent_to_sector (inode, from / FS_BLOCK_SIZE);
+          if (sector != HOLE)
+            bufcache_write (fs_device, sector, zeros, sector_ofs, chunk,
+                            data_class (&inode->data));
+          from += chunk;
+        }
     }
-    free_map_release(inode->data.singly_indirect_ptr, 1);
-    num_sectors -= count;
-  }
+  lock_release (&inode->map_lock);
+}
 
-  if (num_sectors > 0) {
-    struct indirect_block doubly_indirect;
-    bufcache_read(fs_device, inode->data.doubly_indirect_ptr, &doubly_indirect, 0, BLOCK_SECTOR_SIZE);
-    int num_indirect_blocks = DIV_ROUND_UP (num_sectors, BLOCK_SECTOR_SIZE);
-    for (int i = 0; i < num_indirect_blocks; i++) {
-      struct indirect_block indirect;
-      bufcache_read(fs_device, doubly_indirect.blocks[i], &indirect, 0, BLOCK_SECTOR_SIZE);
-      for (count = 0; count < NUM_BLOCKS_IN_INDIRECT && count < num_sectors; count++) {
-        free_map_release (indirect.blocks[count], 1);
-      }
-      free_map_release(doubly_indirect.blocks[i], 1);
-      num_sectors -= count;
+/* Runs of sectors that the reclaim worker has gathered for release,
+   up to RECLAIM_BATCH of them, so that the free map is updated once
+   per batch rather than once per sector. */
+#define RECLAIM_BATCH 64
+struct reclaim_batch
+  {
+    struct free_run runs[RECLAIM_BATCH];
+    size_t cnt;
+  };
+
+/* Releases the sectors in BATCH and empties it. */
+static void
+batch_flush (struct reclaim_batch *batch)
+{
+  free_map_release_runs (batch->runs, batch->cnt);
+  batch->cnt = 0;
+}
+
+/* Adds the CNT sectors starting at SECTOR, unless they are a hole,
+   to BATCH, releasing BATCH first if it is full. */
+static void
+batch_add (struct reclaim_batch *batch, block_sector_t sector, size_t cnt)
+{
+  if (sector == HOLE)
+    return;
+  if (batch->cnt > 0)
+    {
+      struct free_run *last = &batch->runs[batch->cnt - 1];
+      if (last->start + last->cnt == sector)
+        {
+          last->cnt += cnt;
+          return;
+        }
     }
-    free_map_release(inode->data.doubly_indirect_ptr, 1);
-  }
-  free_map_release(inode->sector, 1);
-  return true;
+  if (batch->cnt == RECLAIM_BATCH)
+    batch_flush (batch);
+  batch->runs[batch->cnt].start = sector;
+  batch->runs[batch->cnt].cnt = cnt;
+  batch->cnt++;
+}
+
+/* Adds the first CNT data sectors listed in the indirect block in
+   SECTOR, then the indirect block itself, to BATCH. */
+static void
+reclaim_indirect (struct reclaim_batch *batch, block_sector_t sector,
+                  size_t cnt)
+{
+  if (sector == HOLE)
+    return;
+
+  struct indirect_block *indirect = bufcache_get (fs_device, sector, BC_INDIRECT);
+  for (size_t i = 0; i < cnt; i++)
+    batch_add (batch, indirect->blocks[i], 1);
+  bufcache_put (fs_device, sector, false);
+  batch_add (batch, sector, 1);
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Releases every sector of removed INODE: its data blocks, the
+   blocks that map them, and finally the inode itself. */
+static void
+reclaim_file (struct inode *inode)
+{
+  const struct inode_disk *disk = &inode->data;
+  size_t num_sectors = bytes_to_sectors (disk->length);
+  struct reclaim_batch batch;
+  size_t cnt;
+
+  batch.cnt = 0;
+  if (disk->layout == LAYOUT_EXTENTS)
+    {
+      for (size_t i = 0; i < disk->extent_cnt; i++)
+        {
+          struct extent extent = extent_get (disk, i);
+          batch_add (&batch, extent.start, extent.len);
+        }
+      if (disk->extent_cnt > NUM_EXTENTS)
+        batch_add (&batch, disk->extent_block, 1);
+    }
+  else if (disk->layout == LAYOUT_BLOCK_MAP)
+    {
+      cnt = num_sectors < NUM_DIRECT ? num_sectors : NUM_DIRECT;
+      for (size_t i = 0; i < cnt; i++)
+        batch_add (&batch, disk->direct_ptrs[i], 1);
+      num_sectors -= cnt;
+
+      if (num_sectors > 0)
+        {
+          cnt = num_sectors < NUM_BLOCKS_IN_INDIRECT ? num_sectors : NUM_BLOCKS_IN_INDIRECT;
+          reclaim_indirect (&batch, disk->singly_indirect_ptr, cnt);
+          num_sectors -= cnt;
+        }
+
+      if (num_sectors > 0 && disk->doubly_indirect_ptr != HOLE)
+        {
+          block_sector_t doubly = disk->doubly_indirect_ptr;
+          for (size_t i = 0; num_sectors > 0; i++)
+            {
+              cnt = num_sectors < NUM_BLOCKS_IN_INDIRECT ? num_sectors : NUM_BLOCKS_IN_INDIRECT;
+              reclaim_indirect (&batch, indirect_lookup (doubly, i), cnt);
+              num_sectors -= cnt;
+            }
+          batch_add (&batch, doubly, 1);
+        }
+    }
+  batch_add (&batch, inode->sector, 1);
+  batch_flush (&batch);
+}
+
+/* Open inodes, indexed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  Also holds the inodes on
+   closed_inodes. */
+static struct hash open_inodes;
+
+/* Inodes recently closed by their last opener, most recent first.
+   Each is kept in memory, with open_cnt 0, until CLOSED_MAX others
+   have been closed after it, so that reopening it soon does not
+   read its sector again. */
+#define CLOSED_MAX 32
+static struct list closed_inodes;
+static size_t closed_cnt;
+
+/* Protects open_inodes, closed_inodes, closed_cnt and the open_cnt
+   of every inode.  Acquired before an inode's map_lock. */
 static struct lock open_inodes_lock;
 
+/* Inodes whose in-memory inode_disk has changed since it was last
+   copied into the buffer cache.  Only these are ever stored, in
+   sector order, by write_back_inodes(), by inode_sync(), or when
+   they leave closed_inodes.  An inode opened only to be read is
+   never written at all.  Acquired after open_inodes_lock and an
+   inode's inode_lock. */
+static struct list dirty_inodes;
+static struct lock dirty_lock;
+
+/* Removed inodes whose sectors the reclaim worker has yet to
+   release, oldest first.  An inode stays at the front until its
+   sectors are all released, so the queue is empty only once no
+   reclamation is under way. */
+static struct list reclaim_queue;
+static struct lock reclaim_lock;
+static struct condition until_reclaim_work;
+static struct condition until_reclaimed;    /* Queue became empty. */
+
+static void reclaim_worker (void *aux UNUSED);
+
+static void flush_metadata (void);
+static struct inode *find_inode (block_sector_t);
+
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  return hash_int (hash_entry (e, struct inode, elem)->sector);
+}
+
+static bool
+inode_less (const struct hash_elem *a, const struct hash_elem *b,
+            void *aux UNUSED)
+{
+  return (hash_entry (a, struct inode, elem)->sector
+          < hash_entry (b, struct inode, elem)->sector);
+}
+
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
+  if (!hash_init (&open_inodes, inode_hash, inode_less, NULL))
+    PANIC ("open inode table creation failed");
+  list_init (&closed_inodes);
   lock_init(&open_inodes_lock);
+  list_init (&dirty_inodes);
+  lock_init (&dirty_lock);
+  bufcache_on_flush (flush_metadata);
+
+  list_init (&reclaim_queue);
+  lock_init (&reclaim_lock);
+  cond_init (&until_reclaim_work);
+  cond_init (&until_reclaimed);
+  free_map_on_full (inode_wait_reclaim);
+  thread_create ("inode-reclaim", PRI_DEFAULT, reclaim_worker, NULL);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  Files are laid out in extents, so that they can be
+   allocated and read in long runs; directories, which grow a few
+   entries at a time among other allocations, keep the block map.
+   A file of no more than INLINE_MAX bytes starts out with its data
+   in the inode instead, and costs no data blocks until it grows.
+   The LENGTH bytes start out as a hole that reads as zeros; their
+   blocks are allocated as they are first written.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool
-inode_create (block_sector_t sector, off_t length)
+inode_create (block_sector_t sector, off_t length, bool isdir)
 {
   struct inode_disk *disk_inode = NULL;
   bool success = false;
@@ -260,25 +1328,170 @@ inode_create (block_sector_t sector, off_t length)
   disk_inode = calloc (1, sizeof *disk_inode);
   if (disk_inode != NULL)
     {
-      size_t sectors = bytes_to_sectors (length);
       disk_inode->magic = INODE_MAGIC;
-      if (allocate_file(NULL, disk_inode, length))
+      disk_inode->isdir = isdir;
+      if (isdir)
+        disk_inode->layout = LAYOUT_BLOCK_MAP;
+      else if (length <= (off_t) INLINE_MAX)
+        disk_inode->layout = LAYOUT_INLINE;
+      else
+        disk_inode->layout = LAYOUT_EXTENTS;
+      if (create_holes(disk_inode, length))
         {
           disk_inode->length = length;
-          bufcache_write(fs_device, sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
-          /*if (sectors > 0)
-            {
-              static char zeros[BLOCK_SECTOR_SIZE];
-              size_t i;
+          journal_add (sector, BC_INODE);
+          bufcache_write(fs_device, sector, disk_inode, 0, BLOCK_SECTOR_SIZE, BC_INODE);
+          success = true;
+        }
+      free (disk_inode);
+    }
+  return success;
+}
+
+/* Notes that INODE's inode_disk has changed.  INODE's inode_lock
+   must be held. */
+static void
+mark_dirty (struct inode *inode)
+{
+  lock_acquire (&dirty_lock);
+  if (!inode->dirty)
+    {
+      inode->dirty = true;
+      list_push_back (&dirty_inodes, &inode->dirty_elem);
+    }
+  lock_release (&dirty_lock);
+}
+
+/* Takes INODE off dirty_inodes and returns whether it was there. */
+static bool
+clear_dirty (struct inode *inode)
+{
+  bool was_dirty;
+
+  lock_acquire (&dirty_lock);
+  was_dirty = inode->dirty;
+  if (was_dirty)
+    {
+      inode->dirty = false;
+      list_remove (&inode->dirty_elem);
+    }
+  lock_release (&dirty_lock);
+  return was_dirty;
+}
+
+/* Copies INODE's in-memory inode_disk into the buffer cache, if it
+   has changed since it was last copied.  Filling holes changes the
+   block pointers under map_lock alone, and the length changes under
+   inode_lock, so both are held for the copy, map_lock first as
+   write_inline() takes them. */
+static void
+store_inode (struct inode *inode)
+{
+  lock_acquire (&inode->map_lock);
+  lock_acquire (&inode->inode_lock);
+  if (clear_dirty (inode))
+    {
+      journal_add (inode->sector, BC_INODE);
+      bufcache_write(fs_device, inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE, BC_INODE);
+    }
+  lock_release (&inode->inode_lock);
+  lock_release (&inode->map_lock);
+}
+
+static int
+compare_sectors (const void *a_, const void *b_)
+{
+  const block_sector_t *a = a_;
+  const block_sector_t *b = b_;
+  if (*a < *b)
+    return -1;
+  return *a > *b;
+}
+
+/* Stores every dirty inode into the buffer cache, in sector order,
+   so that the write-back that follows finds them sorted among the
+   other dirty metadata.  Each JOURNAL_OP_MAX inodes are stored by
+   an operation of their own. */
+static void
+write_back_inodes (void)
+{
+  block_sector_t *sectors;
+  struct list_elem *e;
+  size_t cnt = 0, i;
+
+  /* An inode is taken off dirty_inodes before it is freed, so those
+     on it can be looked at while dirty_lock is held. */
+  lock_acquire (&dirty_lock);
+  sectors = malloc (list_size (&dirty_inodes) * sizeof *sectors);
+  if (sectors != NULL)
+    for (e = list_begin (&dirty_inodes); e != list_end (&dirty_inodes);
+         e = list_next (e))
+      sectors[cnt++] = list_entry (e, struct inode, dirty_elem)->sector;
+  lock_release (&dirty_lock);
 
-              for (i = 0; i < sectors; i++)
-                bufcache_write(fs_device, byte_to_sector (const struct inode *inode,i * BLOCK_SECTOR_SIZE) disk_inode->start + i, zeros, 0, BLOCK_SECTOR_SIZE);
-            } */
-          success = true;
+  /* Holding open_inodes_lock keeps the inodes found from being
+     freed, but it cannot be held across journal_begin(). */
+  qsort (sectors, cnt, sizeof *sectors, compare_sectors);
+  for (i = 0; i < cnt; i++)
+    {
+      struct inode *inode;
+
+      if (i % JOURNAL_OP_MAX == 0)
+        {
+          journal_begin ();
+          lock_acquire (&open_inodes_lock);
+        }
+      inode = find_inode (sectors[i]);
+      if (inode != NULL)
+        store_inode (inode);
+      if ((i + 1) % JOURNAL_OP_MAX == 0 || i + 1 == cnt)
+        {
+          lock_release (&open_inodes_lock);
+          journal_end ();
         }
-      free (disk_inode);
     }
-  return success;
+  free (sectors);
+}
+
+/* Run by the buffer cache's flusher for each periodic write-back,
+   in the same order as inode_sync_all(): stores the inodes that
+   changed, writes back the file data they may now point to, and only
+   then commits them to the journal along with every other metadata
+   change since the last commit.  So a committed inode never points
+   at data that has yet to reach the disk. */
+static void
+flush_metadata (void)
+{
+  write_back_inodes ();
+  bufcache_flush ();
+  journal_commit ();
+}
+
+/* Adds an opener to INODE, taking it off closed_inodes if it was
+   there, and returns it.  Must be called with open_inodes_lock
+   held. */
+static struct inode *
+reuse (struct inode *inode)
+{
+  if (inode->open_cnt++ == 0)
+    {
+      list_remove (&inode->closed_elem);
+      closed_cnt--;
+    }
+  return inode;
+}
+
+/* Returns the inode in memory for SECTOR, or a null pointer if
+   there is none.  Must be called with open_inodes_lock held. */
+static struct inode *
+find_inode (block_sector_t sector)
+{
+  struct inode key;
+  struct hash_elem *e;
+
+  key.sector = sector;
+  e = hash_find (&open_inodes, &key.elem);
+  return e != NULL ? hash_entry (e, struct inode, elem) : NULL;
 }
 
 /* Reads an inode from SECTOR
@@ -287,23 +1500,17 @@ inode_create (block_sector_t sector, off_t length)
 struct inode *
 inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
+  struct hash_elem *e;
   struct inode *inode;
 
   lock_acquire(&open_inodes_lock);
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
-        {
-          inode_reopen (inode);
-          lock_release(&open_inodes_lock);
-          return inode;
-        }
-    }
+  /* Check whether this inode is already open, or recently was. */
+  inode = find_inode (sector);
+  if (inode != NULL)
+    reuse (inode);
   lock_release(&open_inodes_lock);
+  if (inode != NULL)
+    return inode;
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
@@ -311,19 +1518,32 @@ inode_open (block_sector_t sector)
     return NULL;
 
   /* Initialize. */
-  lock_acquire(&open_inodes_lock);
-  list_push_front (&open_inodes, &inode->elem);
-  lock_release(&open_inodes_lock);
-
   cond_init(&inode->until_no_writers);
-  cond_init(&inode->until_not_extending);
+  list_init(&inode->ranges);
+  cond_init(&inode->until_range_free);
   lock_init(&inode->inode_lock);
+  lock_init(&inode->map_lock);
+  lock_init(&inode->dir_lock);
+  inode->map = NULL;
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  inode->extending = false;
-  bufcache_read(fs_device, inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
+  inode->dirty = false;
+  inode->ra_next = 0;
+  inode->ra_end = 0;
+  inode->ra_window = 0;
+  bufcache_read(fs_device, inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE, BC_INODE);
+
+  /* Another thread may have opened the same inode meanwhile. */
+  lock_acquire(&open_inodes_lock);
+  e = hash_insert (&open_inodes, &inode->elem);
+  if (e != NULL)
+    {
+      free (inode);
+      inode = reuse (hash_entry (e, struct inode, elem));
+    }
+  lock_release(&open_inodes_lock);
   return inode;
 }
 
@@ -332,7 +1552,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire(&open_inodes_lock);
+      inode->open_cnt++;
+      lock_release(&open_inodes_lock);
+    }
   return inode;
 }
 
@@ -343,31 +1567,254 @@ inode_get_inumber (const struct inode *inode)
   return inode->sector;
 }
 
-/* Closes INODE and writes it to disk.
-   If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+/* Frees INODE's memory. */
+static void
+free_inode (struct inode *inode)
+{
+  free (inode->map);
+  free (inode);
+}
+
+/* Closes INODE.
+   If this was the last reference to INODE, it joins closed_inodes,
+   and the inode closed longest ago is written, if dirty, and freed
+   if there are too many.  If INODE was also a removed inode, frees
+   its blocks and memory at once without writing it. */
 void
 inode_close (struct inode *inode)
 {
+  struct inode *victim = NULL;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
+  journal_begin ();
+  lock_acquire(&open_inodes_lock);
+  if (--inode->open_cnt > 0)
+    {
+      lock_release(&open_inodes_lock);
+      journal_end ();
+      return;
+    }
+
   /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0)
+  if (inode->removed)
+    {
+      hash_delete (&open_inodes, &inode->elem);
+      clear_dirty (inode);
+      lock_release(&open_inodes_lock);
+
+      /* However big the file, closing it costs no more than this. */
+      lock_acquire (&reclaim_lock);
+      list_push_back (&reclaim_queue, &inode->closed_elem);
+      cond_signal (&until_reclaim_work, &reclaim_lock);
+      lock_release (&reclaim_lock);
+      journal_end ();
+      return;
+    }
+
+  list_push_front (&closed_inodes, &inode->closed_elem);
+  if (++closed_cnt > CLOSED_MAX)
+    {
+      victim = list_entry (list_pop_back (&closed_inodes),
+                           struct inode, closed_elem);
+      hash_delete (&open_inodes, &victim->elem);
+      closed_cnt--;
+      store_inode (victim);
+    }
+  lock_release(&open_inodes_lock);
+  journal_end ();
+
+  if (victim != NULL)
+    free_inode (victim);
+}
+
+/* Releases the sectors of removed inodes in the background, in the
+   order they were closed, and frees the inodes afterward. */
+static void
+reclaim_worker (void *aux UNUSED)
+{
+  lock_acquire (&reclaim_lock);
+  for (;;)
+    {
+      while (list_empty (&reclaim_queue))
+        cond_wait (&until_reclaim_work, &reclaim_lock);
+      struct inode *inode = list_entry (list_front (&reclaim_queue),
+                                        struct inode, closed_elem);
+      lock_release (&reclaim_lock);
+
+      reclaim_file (inode);
+
+      lock_acquire (&reclaim_lock);
+      list_pop_front (&reclaim_queue);
+      free_inode (inode);
+      if (list_empty (&reclaim_queue))
+        cond_broadcast (&until_reclaimed, &reclaim_lock);
+    }
+}
+
+/* Waits until the sectors of every inode removed and closed so far
+   have been released. */
+void
+inode_wait_reclaim (void)
+{
+  lock_acquire (&reclaim_lock);
+  while (!list_empty (&reclaim_queue))
+    cond_wait (&until_reclaimed, &reclaim_lock);
+  lock_release (&reclaim_lock);
+}
+
+/* Stores the first CNT entries of the indirect block in SECTOR,
+   other than holes, followed by SECTOR itself, at *OUT, and
+   advances *OUT past them. */
+static void
+collect_indirect (block_sector_t sector, size_t cnt, block_sector_t **out)
+{
+  if (sector == HOLE)
+    return;
+
+  struct indirect_block *indirect = bufcache_get (fs_device, sector, BC_INDIRECT);
+  for (size_t i = 0; i < cnt; i++)
+    if (indirect->blocks[i] != HOLE)
+      *(*out)++ = indirect->blocks[i];
+  bufcache_put (fs_device, sector, false);
+  *(*out)++ = sector;
+}
+
+/* Returns the number of metadata blocks, besides the inode itself,
+   that map the first NUM_SECTORS data blocks of INODE_DISK. */
+static size_t
+indirect_blocks (const struct inode_disk *inode_disk, size_t num_sectors)
+{
+  if (inode_disk->layout == LAYOUT_INLINE)
+    return 0;
+  if (inode_disk->layout == LAYOUT_EXTENTS)
+    return inode_disk->extent_cnt > NUM_EXTENTS;
+  if (num_sectors <= NUM_DIRECT)
+    return 0;
+  num_sectors -= NUM_DIRECT;
+  if (num_sectors <= NUM_BLOCKS_IN_INDIRECT)
+    return 1;
+  num_sectors -= NUM_BLOCKS_IN_INDIRECT;
+  return 2 + DIV_ROUND_UP (num_sectors, NUM_BLOCKS_IN_INDIRECT);
+}
+
+/* Stores at OUT the sectors of the first NUM_SECTORS data blocks of
+   extent-layout INODE_DISK, and of its overflow block.  Returns the
+   number of sectors stored. */
+static size_t
+collect_extents (const struct inode_disk *inode_disk, size_t num_sectors,
+                 block_sector_t *out)
+{
+  block_sector_t *start = out;
+
+  for (size_t i = 0; i < inode_disk->extent_cnt && num_sectors > 0; i++)
+    {
+      struct extent extent = extent_get (inode_disk, i);
+      for (size_t j = 0; j < extent.len && num_sectors > 0; j++, num_sectors--)
+        if (extent.start != HOLE)
+          *out++ = extent.start + j;
+    }
+  if (inode_disk->extent_cnt > NUM_EXTENTS)
+    *out++ = inode_disk->extent_block;
+  return out - start;
+}
+
+/* Stores at OUT the sectors of the first NUM_SECTORS data blocks of
+   INODE_DISK and of the indirect blocks that lead to them.  Returns
+   the number of sectors stored. */
+static size_t
+collect_sectors (const struct inode_disk *inode_disk, size_t num_sectors,
+                 block_sector_t *out)
+{
+  block_sector_t *start = out;
+  size_t cnt = num_sectors < NUM_DIRECT ? num_sectors : NUM_DIRECT;
+
+  if (inode_disk->layout == LAYOUT_INLINE)
+    return 0;
+  if (inode_disk->layout == LAYOUT_EXTENTS)
+    return collect_extents (inode_disk, num_sectors, out);
+
+  for (size_t i = 0; i < cnt; i++)
+    if (inode_disk->direct_ptrs[i] != HOLE)
+      *out++ = inode_disk->direct_ptrs[i];
+  num_sectors -= cnt;
+
+  if (num_sectors > 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
+      cnt = num_sectors < NUM_BLOCKS_IN_INDIRECT ? num_sectors : NUM_BLOCKS_IN_INDIRECT;
+      collect_indirect (inode_disk->singly_indirect_ptr, cnt, &out);
+      num_sectors -= cnt;
+    }
 
-      bufcache_write(fs_device, inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
-      /* Deallocate blocks if removed. */
-      if (inode->removed)
+  if (num_sectors > 0 && inode_disk->doubly_indirect_ptr != HOLE)
+    {
+      block_sector_t doubly = inode_disk->doubly_indirect_ptr;
+      for (size_t i = 0; num_sectors > 0; i++)
         {
-          deallocate_file(inode);
+          cnt = num_sectors < NUM_BLOCKS_IN_INDIRECT ? num_sectors : NUM_BLOCKS_IN_INDIRECT;
+          collect_indirect (indirect_lookup (doubly, i), cnt, &out);
+          num_sectors -= cnt;
         }
+      *out++ = doubly;
+    }
+  return out - start;
+}
 
-      free (inode);
+/* Writes INODE's data to disk, and returns once it is durable.
+   Data blocks are written first, and only then is the inode, with
+   the indirect blocks and free map changes that go with it,
+   committed to the journal, so that a file never points at blocks
+   whose contents did not reach the disk.  Indirect blocks still
+   waiting for a commit are left to it. */
+void
+inode_sync (struct inode *inode)
+{
+  lock_acquire (&inode->inode_lock);
+  size_t num_sectors = bytes_to_sectors (inode->data.length);
+  lock_release (&inode->inode_lock);
+
+  /* Filling holes rearranges the block pointers, so they are
+     walked under map_lock. */
+  if (num_sectors > 0)
+    {
+      block_sector_t *sectors;
+      size_t cnt;
+
+      lock_acquire (&inode->map_lock);
+      cnt = num_sectors + indirect_blocks (&inode->data, num_sectors);
+      sectors = malloc (cnt * sizeof *sectors);
+      if (sectors != NULL)
+        cnt = collect_sectors (&inode->data, num_sectors, sectors);
+      lock_release (&inode->map_lock);
+
+      if (sectors != NULL)
+        {
+          bufcache_flush_sectors (fs_device, sectors, cnt);
+          free (sectors);
+        }
+      else
+        bufcache_flush ();
     }
+
+  journal_begin ();
+  store_inode (inode);
+  journal_end ();
+  journal_commit ();
+}
+
+/* Writes every dirty inode, and everything else in the buffer
+   cache, to disk, file data first and then, through the journal,
+   the metadata.  Removed files are reclaimed first, so that the
+   sync frees their sectors on disk too. */
+void
+inode_sync_all (void)
+{
+  inode_wait_reclaim ();
+  write_back_inodes ();
+  bufcache_flush ();
+  journal_commit ();
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -379,40 +1826,198 @@ inode_remove (struct inode *inode)
   inode->removed = true;
 }
 
-/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
-   Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
-off_t
-inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
+/* Updates INODE's read-ahead state for a read of blocks FIRST
+   through LAST, and stores in *START and *END the range of blocks
+   that should now be read ahead.  A read that continues where the
+   previous one stopped doubles the window, up to RA_MAX_WINDOW; any
+   other read halves it.  INODE's lock must be held. */
+static void
+readahead_update (struct inode *inode, size_t first, size_t last,
+                  size_t *start, size_t *end)
 {
-  uint8_t *buffer = buffer_;
-  off_t bytes_read = 0;
+  size_t file_blocks = bytes_to_sectors (inode->data.length);
 
+  if (first == inode->ra_next)
+    {
+      inode->ra_window *= 2;
+      if (inode->ra_window < RA_MIN_WINDOW)
+        inode->ra_window = RA_MIN_WINDOW;
+      if (inode->ra_window > RA_MAX_WINDOW)
+        inode->ra_window = RA_MAX_WINDOW;
+    }
+  else if (first + 1 != inode->ra_next)
+    {
+      inode->ra_window /= 2;
+      inode->ra_end = 0;
+    }
+  inode->ra_next = last + 1;
 
-  lock_acquire(&inode->inode_lock);
-  while (inode->extending || inode->deny_write_cnt < 0) {
-    if (inode->extending) {
-      cond_wait(&inode->until_not_extending, &inode->inode_lock);
+  *start = inode->ra_end > last + 1 ? inode->ra_end : last + 1;
+  *end = last + 1 + inode->ra_window;
+  if (*end > file_blocks)
+    *end = file_blocks;
+  if (*start < *end)
+    inode->ra_end = *end;
+}
+
+/* Bytes START up to END of an inode, held for reading or writing
+   for the length of one inode_read_at() or inode_write_at(). */
+struct range_lock
+  {
+    struct list_elem elem;              /* Element in inode's ranges. */
+    off_t start;                        /* First byte held. */
+    off_t end;                          /* One past the last byte held. */
+    bool write;                         /* Held for writing? */
+  };
+
+/* Holds everything from some offset to the end of any file. */
+#define RANGE_EOF INT32_MAX
+
+/* Returns true if RANGE conflicts with one held by another thread
+   on INODE: if they overlap and either is held for writing. */
+static bool
+range_conflicts (struct inode *inode, const struct range_lock *range)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&inode->ranges); e != list_end (&inode->ranges);
+       e = list_next (e))
+    {
+      struct range_lock *held = list_entry (e, struct range_lock, elem);
+      if (held->start < range->end && range->start < held->end
+          && (held->write || range->write))
+        return true;
     }
-    if (inode->deny_write_cnt < 0) {
-      cond_wait(&inode->until_no_writers, &inode->inode_lock);
+  return false;
+}
+
+/* Waits until bytes START up to END of INODE may be held for
+   writing, if WRITE, or reading, if not, then holds them in RANGE.
+   Readers and writers of disjoint ranges do not wait for each
+   other.  INODE's inode_lock must be held. */
+static void
+range_acquire (struct inode *inode, struct range_lock *range,
+               off_t start, off_t end, bool write)
+{
+  range->start = start;
+  range->end = end;
+  range->write = write;
+  while (range_conflicts (inode, range))
+    cond_wait (&inode->until_range_free, &inode->inode_lock);
+  list_push_back (&inode->ranges, &range->elem);
+}
+
+/* Releases RANGE of INODE.  INODE's inode_lock must be held. */
+static void
+range_release (struct inode *inode, struct range_lock *range)
+{
+  list_remove (&range->elem);
+  cond_broadcast (&inode->until_range_free, &inode->inode_lock);
+}
+
+/* Most blocks moved by one direct transfer. */
+#define DIRECT_RUN 32
+
+/* Returns how many of the CNT blocks of INODE starting at block
+   BLOCK_NUM, which is in SECTOR, lie in consecutive sectors, up to
+   DIRECT_RUN. */
+static size_t
+direct_run (struct inode *inode, size_t block_num, block_sector_t sector,
+            size_t cnt)
+{
+  size_t n = 1;
+
+  if (cnt > DIRECT_RUN)
+    cnt = DIRECT_RUN;
+  while (n < cnt
+         && byte_to_sector (inode, (block_num + n) * FS_BLOCK_SIZE) == sector + n)
+    n++;
+  return n;
+}
+
+/* Reads the CNT blocks starting at SECTOR from disk into BUFFER,
+   bypassing the buffer cache, after writing back any cached copy
+   that is newer than the disk.  The flush skips blocks held by the
+   journal, but file data never is, even in a block that was
+   metadata before: see free_map_release(). */
+static void
+read_direct (block_sector_t sector, size_t cnt, uint8_t *buffer)
+{
+  block_sector_t sectors[DIRECT_RUN];
+  void *buffers[DIRECT_RUN];
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    {
+      sectors[i] = sector + i;
+      buffers[i] = buffer + i * FS_BLOCK_SIZE;
     }
-  }
+  bufcache_flush_sectors (fs_device, sectors, cnt);
+  filesys_read_blocks (fs_device, sector, cnt, buffers);
+}
+
+/* Writes CNT blocks from BUFFER to disk starting at SECTOR,
+   bypassing the buffer cache.  Cached copies are dropped before the
+   write, so that a dirty one cannot be written back over it, and
+   again after, in case read-ahead loaded one meanwhile. */
+static void
+write_direct (block_sector_t sector, size_t cnt, const uint8_t *buffer)
+{
+  const void *buffers[DIRECT_RUN];
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    buffers[i] = buffer + i * FS_BLOCK_SIZE;
+  bufcache_discard (fs_device, sector, cnt);
+  filesys_write_blocks (fs_device, sector, cnt, buffers);
+  bufcache_discard (fs_device, sector, cnt);
+}
+
+/* Reads SIZE bytes from INODE into BUFFER, starting at position
+   OFFSET, as inode_read_at() does.  If DIRECT, whole blocks go
+   straight from the disk to BUFFER instead of through the buffer
+   cache, and nothing is read ahead. */
+static off_t
+read_at (struct inode *inode, void *buffer_, off_t size, off_t offset,
+         bool direct)
+{
+  uint8_t *buffer = buffer_;
+  off_t bytes_read = 0;
+  size_t ra_start = 0, ra_end = 0;
+  struct range_lock range;
+
+  /* Only writes that overlap this read hold it up, including an
+     extension of the file past OFFSET + SIZE. */
+  lock_acquire(&inode->inode_lock);
+  range_acquire(inode, &range, offset, offset + size, false);
   if (offset + size > inode->data.length) {
+    range_release(inode, &range);
     lock_release(&inode->inode_lock);
     return -1;
   }
+  /* Read-ahead loads blocks as file data, so directories, whose
+     blocks the cache treats as metadata, are not read ahead. */
+  if (size > 0 && !direct && !inode->data.isdir)
+    readahead_update (inode, offset / FS_BLOCK_SIZE,
+                      (offset + size - 1) / FS_BLOCK_SIZE,
+                      &ra_start, &ra_end);
   lock_release(&inode->inode_lock);
 
+  if (size > 0 && read_inline (inode, buffer, size, offset))
+    {
+      bytes_read = size;
+      size = 0;
+    }
+
   while (size > 0)
     {
       /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (&inode->data, offset);
-      int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      int sector_ofs = offset % FS_BLOCK_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
       off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      int sector_left = FS_BLOCK_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually copy out of this sector. */
@@ -421,7 +2026,18 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
         break;
 
       //block_read (fs_device, sector_idx, bounce);
-      bufcache_read(fs_device, sector_idx, (void*) buffer + bytes_read, sector_ofs, chunk_size);
+      if (sector_idx == HOLE)
+        memset (buffer + bytes_read, 0, chunk_size);
+      else if (direct && chunk_size == FS_BLOCK_SIZE)
+        {
+          off_t whole = size < inode_left ? size : inode_left;
+          size_t cnt = direct_run (inode, offset / FS_BLOCK_SIZE, sector_idx,
+                                   whole / FS_BLOCK_SIZE);
+          read_direct (sector_idx, cnt, buffer + bytes_read);
+          chunk_size = cnt * FS_BLOCK_SIZE;
+        }
+      else
+        bufcache_read(fs_device, sector_idx, (void*) buffer + bytes_read, sector_ofs, chunk_size, data_class(&inode->data));
 
       /* Advance. */
       size -= chunk_size;
@@ -429,70 +2045,317 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       bytes_read += chunk_size;
     }
 
+  lock_acquire(&inode->inode_lock);
+  range_release(inode, &range);
+  lock_release(&inode->inode_lock);
+
+  /* Start fetching the blocks a sequential reader will want next. */
+  for (; ra_start < ra_end; ra_start++)
+    {
+      block_sector_t sector = byte_to_sector (inode, ra_start * FS_BLOCK_SIZE);
+      if (sector != HOLE)
+        bufcache_readahead (fs_device, sector);
+    }
+
   return bytes_read;
 }
 
-/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
-   Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
+   Returns the number of bytes actually read, which may be less
+   than SIZE if an error occurs or end of file is reached. */
 off_t
-inode_write_at (struct inode *inode, const void *buffer_, off_t size,
-                off_t offset)
+inode_read_at (struct inode *inode, void *buffer, off_t size, off_t offset)
+{
+  return read_at (inode, buffer, size, offset, false);
+}
+
+/* Reads SIZE bytes from INODE into BUFFER, starting at position
+   OFFSET, like inode_read_at(), except that whole blocks bypass the
+   buffer cache.  Any part of a block, and any cached copy that is
+   newer than the disk, still goes through it.  Meant for long
+   sequential transfers, which would otherwise push everything else
+   out of the cache. */
+off_t
+inode_read_direct (struct inode *inode, void *buffer, off_t size, off_t offset)
+{
+  return read_at (inode, buffer, size, offset, true);
+}
+
+/* How write_at() gets data to the disk. */
+enum write_mode
+  {
+    WRITE_CACHED,               /* Through the cache, logged if metadata. */
+    WRITE_DIRECT,               /* Whole blocks of file data bypass cache. */
+    WRITE_UNLOGGED              /* Never logged, on disk when done. */
+  };
+
+/* Writes the blocks of INODE that hold bytes OFFSET up to END to
+   disk, if the buffer cache has them dirty. */
+static void
+flush_range (struct inode *inode, off_t offset, off_t end)
+{
+  size_t first = offset / FS_BLOCK_SIZE;
+  size_t last = DIV_ROUND_UP (end, FS_BLOCK_SIZE);
+  block_sector_t *sectors;
+  size_t cnt = 0;
+  size_t i;
+
+  if (first >= last)
+    return;
+  sectors = malloc ((last - first) * sizeof *sectors);
+  if (sectors == NULL)
+    {
+      bufcache_flush ();
+      return;
+    }
+  for (i = first; i < last; i++)
+    {
+      block_sector_t sector = byte_to_sector (inode, i * FS_BLOCK_SIZE);
+      if (sector != HOLE && sector != (block_sector_t) -1)
+        sectors[cnt++] = sector;
+    }
+  bufcache_flush_sectors (fs_device, sectors, cnt);
+  free (sectors);
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   as inode_write_at() does, moving the data as MODE says, in a
+   single operation. */
+static off_t
+write_once (struct inode *inode, const void *buffer_, off_t size,
+            off_t offset, enum write_mode mode)
 {
   const uint8_t *buffer = buffer_;
   off_t bytes_written = 0;
+  off_t start_offset = offset;
+  struct range_lock range;
+  bool direct = mode == WRITE_DIRECT;
+
+  /* Directory and free map contents are metadata, and go through
+     the journal like the inode itself. */
+  bool logged = mode != WRITE_UNLOGGED
+                && (inode->data.isdir || inode->sector == FREE_MAP_SECTOR);
+
+  journal_begin();
   lock_acquire(&inode->inode_lock);
   if (inode->deny_write_cnt > 0) {
     lock_release(&inode->inode_lock);
+    journal_end();
     return 0;
   }
   inode->deny_write_cnt--;
-  lock_release(&inode->inode_lock);
 
-  lock_acquire(&inode->inode_lock);
-  while (inode->extending) {
-    cond_wait(&inode->until_not_extending, &inode->inode_lock);
-  }
+  /* A write past end of file holds everything from there on, so
+     extensions happen one at a time, while writes and reads within
+     the file carry on.  The length only grows, so a write that fits
+     when the range is requested still fits once it is held. */
   if (size + offset > inode->data.length) {
-    allocate_file(inode, &inode->data, size + offset);
+    off_t start = offset < inode->data.length ? offset : inode->data.length;
+    range_acquire(inode, &range, start, RANGE_EOF, true);
   } else {
+    range_acquire(inode, &range, offset, offset + size, true);
+  }
+  lock_release(&inode->inode_lock);
+
+  /* A small file is written in place in its inode, until a write
+     makes it too big to stay there. */
+  if (size > 0) {
+    off_t written = write_inline (inode, buffer, size, offset);
+    if (written >= 0) {
+      bytes_written = written;
+      size = 0;
+    }
+  }
+
+  /* Extending the file allocates only the blocks this write covers,
+     unless they were reserved already; any gap before OFFSET is
+     left as a hole. */
+  /* If not all of them can be, the file grows only as far as they
+     go, so that no block past its end is left allocated. */
+  if (size > 0 && size + offset > inode_length (inode)) {
+    zero_reserved (inode, inode_length (inode), offset);
+    off_t filled = fill_blocks (inode, offset, size);
+    if (filled > inode_length (inode)) {
+      lock_acquire(&inode->inode_lock);
+      inode->data.length = filled;
+      mark_dirty(inode);
       lock_release(&inode->inode_lock);
+    }
   }
   while (size > 0)
     {
       /* Sector to write, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (&inode->data, offset);
-      int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      int sector_ofs = offset % FS_BLOCK_SIZE;
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
       off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      int sector_left = FS_BLOCK_SIZE - sector_ofs;
       int min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually write into this sector. */
       int chunk_size = size < min_left ? size : min_left;
       if (chunk_size <= 0)
         break;
+      if (sector_idx == HOLE) {
+        /* Blocks filled before a failure are written, since they are
+           in the file now and only partly written ones were
+           zeroed. */
+        off_t filled = fill_blocks (inode, offset, size);
+        if (filled == offset)
+          break;
+        size = filled - offset;
+        sector_idx = byte_to_sector (inode, offset);
+        chunk_size = size < chunk_size ? size : chunk_size;
+      }
       //block_write (fs_device, sector_idx, bounce);
-      bufcache_write(fs_device, sector_idx, (void*) buffer + bytes_written, sector_ofs, chunk_size);
+      if (direct && !logged && chunk_size == FS_BLOCK_SIZE) {
+        off_t whole = size < inode_left ? size : inode_left;
+        size_t cnt = direct_run (inode, offset / FS_BLOCK_SIZE, sector_idx,
+                                 whole / FS_BLOCK_SIZE);
+        write_direct (sector_idx, cnt, buffer + bytes_written);
+        chunk_size = cnt * FS_BLOCK_SIZE;
+      } else {
+        if (logged) {
+          /* A write too big for one operation's share of the log
+             stops short. */
+          if (journal_room() == 0)
+            break;
+          journal_add(sector_idx, data_class(&inode->data));
+        }
+        bufcache_write(fs_device, sector_idx, (void*) buffer + bytes_written, sector_ofs, chunk_size, data_class(&inode->data));
+      }
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
     }
+  if (mode == WRITE_UNLOGGED)
+    flush_range (inode, start_offset, start_offset + bytes_written);
 
   lock_acquire(&inode->inode_lock);
+  range_release(inode, &range);
   inode->deny_write_cnt++;
   if (inode->deny_write_cnt == 0) {
     cond_broadcast(&inode->until_no_writers, &inode->inode_lock);
   }
   lock_release(&inode->inode_lock);
+  journal_end();
 
   return bytes_written;
 }
 
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   as write_once() does.  If the write falls short, perhaps because
+   the disk is full, and free_map_make_room() finds sectors that
+   were waiting for a commit, writes the rest once more. */
+static off_t
+write_at (struct inode *inode, const void *buffer, off_t size, off_t offset,
+          enum write_mode mode)
+{
+  off_t written = write_once (inode, buffer, size, offset, mode);
+
+  if (written < size && free_map_make_room ())
+    written += write_once (inode, (const uint8_t *) buffer + written,
+                           size - written, offset + written, mode);
+  return written;
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   Returns the number of bytes actually written, which may be
+   less than SIZE if end of file is reached or an error occurs.
+   (Normally a write at end of file would extend the inode, but
+   growth is not yet implemented.) */
+off_t
+inode_write_at (struct inode *inode, const void *buffer, off_t size,
+                off_t offset)
+{
+  return write_at (inode, buffer, size, offset, WRITE_CACHED);
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   like inode_write_at(), except that whole blocks of file data go
+   to the disk without passing through the buffer cache, and are
+   on disk when it returns. */
+off_t
+inode_write_direct (struct inode *inode, const void *buffer, off_t size,
+                    off_t offset)
+{
+  return write_at (inode, buffer, size, offset, WRITE_DIRECT);
+}
+
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET,
+   like inode_write_at(), except that nothing is logged, not even
+   for a directory, and the data is on disk when it returns.  Only
+   for bytes nothing refers to yet, such as a directory table that
+   one logged write will later switch to: if the system stops
+   before that write commits, they are simply never used. */
+off_t
+inode_write_unlogged (struct inode *inode, const void *buffer, off_t size,
+                      off_t offset)
+{
+  return write_at (inode, buffer, size, offset, WRITE_UNLOGGED);
+}
+
+/* Reserves sectors for the first SIZE bytes of INODE, as
+   inode_allocate() does, in a single operation. */
+static bool
+allocate_once (struct inode *inode, off_t size)
+{
+  struct range_lock range;
+  bool changed = false;
+  bool success = true;
+  off_t length;
+
+  /* Holding everything past end of file keeps writes that extend
+     INODE out until the reservation is made. */
+  journal_begin ();
+  lock_acquire (&inode->inode_lock);
+  range_acquire (inode, &range, inode->data.length, RANGE_EOF, true);
+  length = inode->data.length;
+  lock_release (&inode->inode_lock);
+
+  if (size > length)
+    {
+      lock_acquire (&inode->map_lock);
+      if (inode->data.layout == LAYOUT_INLINE && size > (off_t) INLINE_MAX)
+        success = inline_to_extents (inode);
+      if (!success || inode->data.layout == LAYOUT_INLINE)
+        ;
+      else if (inode->data.layout == LAYOUT_EXTENTS)
+        success = fill_extents (&inode->data, inode->sector, length, size,
+                                &changed);
+      else
+        success = false;
+      lock_release (&inode->map_lock);
+    }
+
+  lock_acquire (&inode->inode_lock);
+  if (changed)
+    mark_dirty (inode);
+  range_release (inode, &range);
+  lock_release (&inode->inode_lock);
+  journal_end ();
+  return success;
+}
+
+/* Reserves sectors for the first SIZE bytes of INODE without
+   changing its length, as runs of consecutive sectors where
+   possible.  Writes that later extend INODE into the reserved
+   blocks use them as they are, with no allocation and no change to
+   the block pointers.  Reserved blocks are released with the file,
+   or if it later turns into a block map, which cannot keep them.
+   Directories and files that already use a block map cannot
+   reserve.  Returns true if successful.  Like a write, tries once
+   more if free_map_make_room() finds sectors waiting for a
+   commit. */
+bool
+inode_allocate (struct inode *inode, off_t size)
+{
+  return (allocate_once (inode, size)
+          || (free_map_make_room () && allocate_once (inode, size)));
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void
@@ -518,6 +2381,22 @@ inode_allow_write (struct inode *inode)
   inode->deny_write_cnt--;
 }
 
+/* Acquires the lock that serializes lookups and updates of the
+   directory stored in INODE.  Inside a journal operation, must be
+   called after journal_begin(). */
+void
+inode_lock_dir (struct inode *inode)
+{
+  lock_acquire (&inode->dir_lock);
+}
+
+/* Releases the lock taken by inode_lock_dir(). */
+void
+inode_unlock_dir (struct inode *inode)
+{
+  lock_release (&inode->dir_lock);
+}
+
 /* Returns the length, in bytes, of INODE's data. */
 off_t
 inode_length (const struct inode *inode)
@@ -8,7 +8,7 @@
 struct bitmap;
 
 void inode_init (void);
-bool inode_create (block_sector_t, off_t);
+bool inode_create (block_sector_t, off_t, bool isdir);
 struct inode *inode_open (block_sector_t);
 struct inode *inode_reopen (struct inode *);
 block_sector_t inode_get_inumber (const struct inode *);
@@ -16,8 +16,18 @@ void inode_close (struct inode *);
 void inode_remove (struct inode *);
 off_t inode_read_at (struct inode *, void *, off_t size, off_t offset);
 off_t inode_write_at (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_read_direct (struct inode *, void *, off_t size, off_t offset);
+off_t inode_write_direct (struct inode *, const void *, off_t size, off_t offset);
+off_t inode_write_unlogged (struct inode *, const void *, off_t size,
+                            off_t offset);
 void inode_deny_write (struct inode *);
 void inode_allow_write (struct inode *);
+void inode_lock_dir (struct inode *);
+void inode_unlock_dir (struct inode *);
 off_t inode_length (const struct inode *);
+void inode_sync (struct inode *);
+void inode_sync_all (void);
+bool inode_allocate (struct inode *, off_t size);
+void inode_wait_reclaim (void);
 
 #endif /* filesys/inode.h */
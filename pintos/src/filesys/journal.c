@@ -0,0 +1,321 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/filesys.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Metadata changes -- to inodes, indirect blocks, directories and
+   the free map -- are logged here before they reach their homes on
+   disk, so that a crash leaves every operation either done or not
+   done at all.
+
+   An operation runs between journal_begin() and journal_end(), and
+   calls journal_add() for each sector before changing it.  Every
+   operation since the last commit belongs to one running
+   transaction.  The sectors it logged are held in the buffer cache,
+   unwritten, until journal_commit() waits for the operations in
+   progress to finish, writes all of their sectors to the log in one
+   request, and then writes the header that commits them.  Only then
+   are the sectors written home, after which the log is emptied
+   again.  Many operations thus share each journal write, and none
+   of them waits for the disk.
+
+   The log holds one transaction at a time.  Each operation in
+   progress has room for JOURNAL_OP_MAX more sectors set aside in
+   it; an operation that would not have that much room waits for a
+   commit before it starts.  So the log never fills up, and every
+   change goes home only after it is logged.  An operation must not
+   log more than JOURNAL_OP_MAX sectors, and one that could, such as
+   rewriting a whole directory, must be split up or built where
+   nothing refers to it yet. */
+
+/* Identifies a journal header. */
+#define JOURNAL_MAGIC 0x4c4e524a
+
+/* First sector of block JOURNAL_SECTOR.  Written last by a commit,
+   as a single sector so that the commit is all or nothing, and
+   emptied once the transaction it describes has been written
+   home. */
+struct journal_header
+  {
+    uint32_t magic;                     /* JOURNAL_MAGIC. */
+    uint32_t cnt;                       /* Sectors logged, or 0 if none. */
+    block_sector_t sectors[JOURNAL_MAX]; /* Home of each logged block. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 8 - JOURNAL_MAX * sizeof (block_sector_t)];
+  };
+
+/* Sectors logged by the running transaction, in the order they
+   were added, and the class of each for the buffer cache. */
+static block_sector_t log_sectors[JOURNAL_MAX];
+static enum bufcache_class log_classes[JOURNAL_MAX];
+static size_t log_cnt;
+
+static int handle_cnt;                  /* Operations in progress. */
+static bool committing;                 /* Commit under way? */
+static unsigned commit_cnt;             /* Commits completed. */
+
+/* Protects everything above. */
+static struct lock journal_lock;
+static struct condition until_no_handles;
+static struct condition until_committed;
+
+/* Staging for the committer, of which there is one at a time:
+   JOURNAL_MAX blocks of FS_BLOCK_SIZE bytes. */
+static struct journal_header header;
+static uint8_t *log_blocks;
+
+/* Returns staging block I. */
+static uint8_t *
+log_block (size_t i)
+{
+  return log_blocks + i * FS_BLOCK_SIZE;
+}
+
+/* Initializes the journal.  Must be called once the cluster size
+   is known. */
+void
+journal_init (void)
+{
+  log_blocks = malloc (JOURNAL_MAX * FS_BLOCK_SIZE);
+  if (log_blocks == NULL)
+    PANIC ("journal allocation failed");
+  lock_init (&journal_lock);
+  cond_init (&until_no_handles);
+  cond_init (&until_committed);
+  log_cnt = 0;
+  handle_cnt = 0;
+  committing = false;
+}
+
+/* Writes HEADER with CNT sectors logged to the journal header
+   sector. */
+static void
+write_header (size_t cnt)
+{
+  header.magic = JOURNAL_MAGIC;
+  header.cnt = cnt;
+  block_write (fs_device, JOURNAL_SECTOR * fs_cluster, &header);
+}
+
+/* Creates an empty journal on a newly formatted disk. */
+void
+journal_create (void)
+{
+  memset (&header, 0, sizeof header);
+  write_header (0);
+}
+
+/* Writes the sectors of the last committed transaction, if it did
+   not get written home before the system went down, to their homes
+   and empties the log.  Must run before anything on the disk is
+   read through the buffer cache. */
+void
+journal_recover (void)
+{
+  size_t i;
+
+  ASSERT (sizeof header == BLOCK_SECTOR_SIZE);
+  block_read (fs_device, JOURNAL_SECTOR * fs_cluster, &header);
+  if (header.magic != JOURNAL_MAGIC || header.cnt > JOURNAL_MAX)
+    PANIC ("file system has no journal, reformat it");
+  if (header.cnt == 0)
+    return;
+
+  printf ("Replaying file system journal...");
+  for (i = 0; i < header.cnt; i++)
+    {
+      const void *buffer = log_block (i);
+
+      filesys_read_block (fs_device, JOURNAL_SECTOR + 1 + i, log_block (i));
+      filesys_write_blocks (fs_device, header.sectors[i], 1, &buffer);
+    }
+  write_header (0);
+  printf ("done.\n");
+}
+
+/* Writes the CNT sectors of the running transaction to the log,
+   commits them, writes them home and empties the log again.  Must
+   be called with no operations in progress, so that nothing
+   changes the logged sectors meanwhile. */
+static void
+write_log (size_t cnt)
+{
+  const void *buffers[JOURNAL_MAX];
+  size_t i;
+
+  for (i = 0; i < cnt; i++)
+    {
+      bufcache_read (fs_device, log_sectors[i], log_block (i), 0,
+                     FS_BLOCK_SIZE, log_classes[i]);
+      buffers[i] = log_block (i);
+      header.sectors[i] = log_sectors[i];
+    }
+  filesys_write_blocks (fs_device, JOURNAL_SECTOR + 1, cnt, buffers);
+  write_header (cnt);
+
+  for (i = 0; i < cnt; i++)
+    bufcache_release (fs_device, log_sectors[i]);
+  bufcache_flush_sectors (fs_device, header.sectors, cnt);
+  write_header (0);
+}
+
+/* Commits the running transaction once the operations in it have
+   finished.  Must be called with journal_lock held and no commit
+   under way.  Drops journal_lock while writing. */
+static void
+commit (void)
+{
+  ASSERT (lock_held_by_current_thread (&journal_lock));
+  ASSERT (!committing);
+
+  committing = true;
+  while (handle_cnt > 0)
+    cond_wait (&until_no_handles, &journal_lock);
+
+  if (log_cnt > 0)
+    {
+      lock_release (&journal_lock);
+      write_log (log_cnt);
+      lock_acquire (&journal_lock);
+      log_cnt = 0;
+    }
+  commit_cnt++;
+  committing = false;
+  cond_broadcast (&until_committed, &journal_lock);
+}
+
+/* Returns true if the log has room for another operation, along
+   with those in progress, to log JOURNAL_OP_MAX sectors each.  This
+   counts the sectors logged so far twice, both in LOG_CNT and
+   against the room set aside for the operation that logged them.
+   Every logged sector is held in the buffer cache until the commit,
+   so the room is no more than the cache can hold either. */
+static bool
+has_room (void)
+{
+  size_t max = bufcache_hold_max ();
+
+  if (max > JOURNAL_MAX)
+    max = JOURNAL_MAX;
+  return log_cnt + (handle_cnt + 1) * JOURNAL_OP_MAX <= max;
+}
+
+/* Starts an operation that changes metadata.  Operations nest, and
+   only the outermost one can wait, so it must begin before its
+   thread takes any file system lock. */
+void
+journal_begin (void)
+{
+  struct thread *t = thread_current ();
+
+  if (t->journal_depth++ > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  while (committing || !has_room ())
+    if (committing)
+      cond_wait (&until_committed, &journal_lock);
+    else
+      commit ();
+  handle_cnt++;
+  t->journal_cnt = 0;
+  lock_release (&journal_lock);
+}
+
+/* Ends an operation started by journal_begin(). */
+void
+journal_end (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire (&journal_lock);
+  if (--handle_cnt == 0)
+    cond_broadcast (&until_no_handles, &journal_lock);
+  lock_release (&journal_lock);
+}
+
+/* Logs SECTOR, a block of class CLS, as part of the running
+   transaction.  Call within an operation, before changing SECTOR,
+   so that the buffer cache holds on to it from the start.  Panics
+   if the operation has already logged JOURNAL_OP_MAX sectors. */
+void
+journal_add (block_sector_t sector, enum bufcache_class cls)
+{
+  struct thread *t = thread_current ();
+  size_t i;
+
+  ASSERT (t->journal_depth > 0);
+  lock_acquire (&journal_lock);
+  for (i = 0; i < log_cnt; i++)
+    if (log_sectors[i] == sector)
+      break;
+  if (i == log_cnt)
+    {
+      if (t->journal_cnt++ >= JOURNAL_OP_MAX)
+        PANIC ("file system operation logged more than %d blocks",
+               JOURNAL_OP_MAX);
+      ASSERT (log_cnt < JOURNAL_MAX);
+      log_sectors[log_cnt] = sector;
+      log_classes[log_cnt] = cls;
+      log_cnt++;
+      bufcache_hold (fs_device, sector, cls);
+    }
+  lock_release (&journal_lock);
+}
+
+/* Returns how many more sectors the running operation may log. */
+size_t
+journal_room (void)
+{
+  struct thread *t = thread_current ();
+
+  ASSERT (t->journal_depth > 0);
+  return JOURNAL_OP_MAX - t->journal_cnt;
+}
+
+/* Returns true if the running thread is within an operation. */
+bool
+journal_active (void)
+{
+  return thread_current ()->journal_depth > 0;
+}
+
+/* Commits every operation finished so far, returning once they are
+   durable.  Must not be called within an operation. */
+void
+journal_commit (void)
+{
+  ASSERT (thread_current ()->journal_depth == 0);
+  lock_acquire (&journal_lock);
+  if (committing)
+    {
+      /* Everything finished before this call is in the commit
+         under way, since no operation can start during one. */
+      while (committing)
+        cond_wait (&until_committed, &journal_lock);
+    }
+  else
+    commit ();
+  lock_release (&journal_lock);
+}
+
+/* Returns the number of commits completed so far.  Every operation
+   that had finished when this returned N is durable once it returns
+   more than N. */
+unsigned
+journal_commit_cnt (void)
+{
+  unsigned cnt;
+
+  lock_acquire (&journal_lock);
+  cnt = commit_cnt;
+  lock_release (&journal_lock);
+  return cnt;
+}
@@ -0,0 +1,31 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include "devices/block.h"
+#include "filesys/bufcache.h"
+
+/* Most blocks one transaction can log. */
+#define JOURNAL_MAX 48
+
+/* Most blocks one operation may log.  Room for this many is set
+   aside in the log for each operation in progress, so the log never
+   fills up in the middle of one. */
+#define JOURNAL_OP_MAX (JOURNAL_MAX / 3)
+
+/* Blocks the journal takes on disk, starting at JOURNAL_SECTOR: a
+   header followed by room for JOURNAL_MAX logged blocks. */
+#define JOURNAL_SECTORS (1 + JOURNAL_MAX)
+
+void journal_init (void);
+void journal_create (void);
+void journal_recover (void);
+
+void journal_begin (void);
+void journal_end (void);
+void journal_add (block_sector_t, enum bufcache_class);
+size_t journal_room (void);
+bool journal_active (void);
+void journal_commit (void);
+unsigned journal_commit_cnt (void);
+
+#endif /* filesys/journal.h */
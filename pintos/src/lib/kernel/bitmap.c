@@ -28,6 +28,8 @@ struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    elem_type *full;    /* Optional summary: bit I is set if element
+                           I of BITS has all of its bits set. */
   };
 
 /* Returns the index of the element that contains the bit
@@ -69,6 +71,111 @@ last_mask (const struct bitmap *b)
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 
+/* Returns the index of the lowest set bit in X, which must be
+   nonzero. */
+static inline size_t
+first_set (elem_type x)
+{
+  elem_type idx;
+  asm ("bsfl %1, %0" : "=r" (idx) : "rm" (x) : "cc");
+  return idx;
+}
+
+/* Returns the number of set bits in X. */
+static inline size_t
+count_set (elem_type x)
+{
+  x = x - ((x >> 1) & 0x55555555);
+  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+  x = (x + (x >> 4)) & 0x0f0f0f0f;
+  return (x * 0x01010101) >> 24;
+}
+
+/* Returns a mask of the bits of element IDX of B that are part of
+   the bitmap, that is, all of them except in the last element. */
+static inline elem_type
+elem_mask (const struct bitmap *b, size_t idx)
+{
+  return idx == elem_cnt (b->bit_cnt) - 1 ? last_mask (b) : (elem_type) -1;
+}
+
+/* Brings the summary bit for element IDX of B up to date. */
+static inline void
+update_summary (struct bitmap *b, size_t idx)
+{
+  if (b->full != NULL)
+    {
+      elem_type mask = elem_mask (b, idx);
+      if ((b->bits[idx] & mask) == mask)
+        b->full[elem_idx (idx)] |= bit_mask (idx);
+      else
+        b->full[elem_idx (idx)] &= ~bit_mask (idx);
+    }
+}
+
+/* Recomputes every bit of B's summary, if it has one. */
+static void
+rebuild_summary (struct bitmap *b)
+{
+  size_t i;
+
+  for (i = 0; i < elem_cnt (b->bit_cnt); i++)
+    update_summary (b, i);
+}
+
+/* Returns the index of the first element of B at or after IDX that
+   is not entirely set, according to B's summary, or the number of
+   elements if there is none. */
+static size_t
+next_not_full (const struct bitmap *b, size_t idx)
+{
+  size_t cnt = elem_cnt (b->bit_cnt);
+
+  while (idx < cnt)
+    {
+      elem_type word = ~b->full[elem_idx (idx)] & ((elem_type) -1 << (idx % ELEM_BITS));
+      if (word != 0)
+        {
+          idx = elem_idx (idx) * ELEM_BITS + first_set (word);
+          return idx < cnt ? idx : cnt;
+        }
+      idx = (elem_idx (idx) + 1) * ELEM_BITS;
+    }
+  return cnt;
+}
+
+/* Returns the index of the first bit in B between START and END,
+   exclusive, that is set to VALUE, or END if there is none.
+   Examines a whole element at a time, and when looking for false
+   bits skips elements that B's summary shows are entirely set. */
+static size_t
+find_first (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      if (!value && b->full != NULL)
+        {
+          size_t next = next_not_full (b, idx);
+          if (next != idx)
+            {
+              start = next * ELEM_BITS;
+              continue;
+            }
+        }
+
+      elem_type word = value ? b->bits[idx] : ~b->bits[idx];
+      word &= (elem_type) -1 << (start % ELEM_BITS);
+      if (word != 0)
+        {
+          size_t found = idx * ELEM_BITS + first_set (word);
+          return found < end ? found : end;
+        }
+      start = (idx + 1) * ELEM_BITS;
+    }
+  return end;
+}
+
 /* Creation and destruction. */
 
 /* Creates and returns a pointer to a newly allocated bitmap with room for
@@ -83,6 +190,7 @@ bitmap_create (size_t bit_cnt)
     {
       b->bit_cnt = bit_cnt;
       b->bits = malloc (byte_cnt (bit_cnt));
+      b->full = NULL;
       if (b->bits != NULL || bit_cnt == 0)
         {
           bitmap_set_all (b, false);
@@ -105,6 +213,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  b->full = NULL;
   bitmap_set_all (b, false);
   return b;
 }
@@ -124,10 +233,31 @@ bitmap_destroy (struct bitmap *b)
 {
   if (b != NULL)
     {
+      free (b->full);
       free (b->bits);
       free (b);
     }
 }
+
+/* Adds to B a summary with one bit per element of B's bits, set
+   when that element is entirely set, so that searches for unset
+   bits can pass over fully used stretches of B a summary element
+   (ELEM_BITS * ELEM_BITS bits) at a time.  The summary is kept up
+   to date by every function that modifies B, but not atomically:
+   once it is enabled, the caller must serialize all changes to B.
+   Returns false if memory allocation fails. */
+bool
+bitmap_enable_summary (struct bitmap *b)
+{
+  ASSERT (b != NULL);
+  if (b->full != NULL)
+    return true;
+  b->full = calloc (elem_cnt (elem_cnt (b->bit_cnt)), sizeof (elem_type));
+  if (b->full == NULL && b->bit_cnt > 0)
+    return false;
+  rebuild_summary (b);
+  return true;
+}
 
 /* Bitmap size. */
 
@@ -163,6 +293,7 @@ bitmap_mark (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the OR instruction in [IA32-v2b]. */
   asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  update_summary (b, idx);
 }
 
 /* Atomically sets the bit numbered BIT_IDX in B to false. */
@@ -176,6 +307,7 @@ bitmap_reset (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the AND instruction in [IA32-v2a]. */
   asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+  update_summary (b, idx);
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -191,6 +323,7 @@ bitmap_flip (struct bitmap *b, size_t bit_idx)
      is guaranteed to be atomic on a uniprocessor machine.  See
      the description of the XOR instruction in [IA32-v2b]. */
   asm ("xorl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+  update_summary (b, idx);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -213,18 +346,41 @@ bitmap_set_all (struct bitmap *b, bool value)
   bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Returns a mask selecting the bits of the element that holds bit
+   START that lie between START and END, exclusive, and stores in
+   *NEXT the first bit past them. */
+static inline elem_type
+range_mask (size_t start, size_t end, size_t *next)
+{
+  size_t ofs = start % ELEM_BITS;
+  size_t n = ELEM_BITS - ofs;
+  if (n > end - start)
+    n = end - start;
+  *next = start + n;
+  return (n == ELEM_BITS ? (elem_type) -1 : ((elem_type) 1 << n) - 1) << ofs;
+}
+
+/* Sets the CNT bits starting at START in B to VALUE.
+   Each element is updated atomically, as by bitmap_mark(). */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i;
+  size_t end = start + cnt;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set (b, start + i, value);
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      elem_type mask = range_mask (start, end, &start);
+      if (value)
+        asm ("orl %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+      else
+        asm ("andl %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+      update_summary (b, idx);
+    }
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -232,16 +388,19 @@ bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value)
 size_t
 bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i, value_cnt;
+  size_t end = start + cnt;
+  size_t value_cnt = 0;
 
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      value_cnt++;
+  while (start < end)
+    {
+      size_t idx = elem_idx (start);
+      elem_type mask = range_mask (start, end, &start);
+      value_cnt += count_set ((value ? b->bits[idx] : ~b->bits[idx]) & mask);
+    }
   return value_cnt;
 }
 
@@ -250,16 +409,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t i;
-
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return find_first (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -291,20 +445,33 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt)
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
-   If there is no such group, returns BITMAP_ERROR. */
+   If there is no such group, returns BITMAP_ERROR.
+   A candidate group that turns out to contain a bit set to !VALUE
+   is abandoned for the first position past that bit, so no bit is
+   examined more than twice. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
 {
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
+  if (cnt == 0)
+    return start;
   if (cnt <= b->bit_cnt)
     {
       size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i;
+      size_t i = start;
+      while (i <= last)
+        {
+          i = find_first (b, i, last + 1, value);
+          if (i > last)
+            break;
+
+          size_t blocker = find_first (b, i, i + cnt, !value);
+          if (blocker == i + cnt)
+            return i;
+          i = blocker + 1;
+        }
     }
   return BITMAP_ERROR;
 }
@@ -346,6 +513,7 @@ bitmap_read (struct bitmap *b, struct file *file)
       off_t size = byte_cnt (b->bit_cnt);
       success = file_read_at (file, b->bits, size, 0) == size;
       b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+      rebuild_summary (b);
     }
   return success;
 }
@@ -358,6 +526,23 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes to FILE only the bytes of B that hold bits START through
+   START + CNT - 1, at the same offsets bitmap_write() would use.
+   Returns true if successful, false otherwise. */
+bool
+bitmap_write_bits (const struct bitmap *b, struct file *file,
+                   size_t start, size_t cnt)
+{
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (cnt <= b->bit_cnt - start);
+  if (cnt == 0)
+    return true;
+
+  off_t first = start / CHAR_BIT;
+  off_t size = (start + cnt - 1) / CHAR_BIT - first + 1;
+  return file_write_at (file, (const uint8_t *) b->bits + first, size, first) == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
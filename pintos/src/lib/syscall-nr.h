@@ -29,7 +29,17 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Durability. */
+    SYS_FSYNC,                  /* Write a file's data to disk. */
+    SYS_SYNC,                   /* Write all file system data to disk. */
+
+    /* Space management. */
+    SYS_FALLOCATE,              /* Reserve disk space for a file. */
+
+    /* Unbuffered I/O. */
+    SYS_OPEN_DIRECT             /* Open a file bypassing the buffer cache. */
   };
 
 #endif /* lib/syscall-nr.h */
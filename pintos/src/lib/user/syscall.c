@@ -188,3 +188,27 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+fsync (int fd)
+{
+  return syscall1 (SYS_FSYNC, fd);
+}
+
+void
+sync (void)
+{
+  syscall0 (SYS_SYNC);
+}
+
+bool
+fallocate (int fd, unsigned size)
+{
+  return syscall2 (SYS_FALLOCATE, fd, size);
+}
+
+int
+open_direct (const char *file)
+{
+  return syscall1 (SYS_OPEN_DIRECT, file);
+}
@@ -46,4 +46,14 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Durability. */
+bool fsync (int fd);
+void sync (void);
+
+/* Space management. */
+bool fallocate (int fd, unsigned size);
+
+/* Unbuffered I/O. */
+int open_direct (const char *file);
+
 #endif /* lib/user/syscall.h */
@@ -0,0 +1,10 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($data) = random_bytes (70000);
+substr ($data, 0, 4096) = 'y' x 4096;
+substr ($data, 4096, 8192) = 'x' x 8192;
+check_archive ({"stream" => [$data]});
+pass;
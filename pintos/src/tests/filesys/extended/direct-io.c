@@ -0,0 +1,76 @@
+/* Writes a file through a descriptor that bypasses the buffer
+   cache, and checks that it stays consistent with an ordinary
+   descriptor for the same file in both directions: data written
+   through the cache is seen by direct reads, and data written
+   directly replaces what the cache held. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHUNK 4096
+
+static char buf[70000];
+static char check[sizeof buf];
+
+/* Reads all of FD from the start into CHECK and compares it with
+   BUF. */
+static void
+read_and_compare (int fd, const char *name)
+{
+  size_t ofs;
+
+  seek (fd, 0);
+  for (ofs = 0; ofs < sizeof buf; ofs += CHUNK)
+    {
+      size_t size = sizeof buf - ofs < CHUNK ? sizeof buf - ofs : CHUNK;
+      if (read (fd, check + ofs, size) != (int) size)
+        fail ("read %zu bytes at offset %zu in \"%s\" failed",
+              size, ofs, name);
+    }
+  compare_bytes (check, buf, sizeof buf, 0, name);
+}
+
+void
+test_main (void)
+{
+  size_t ofs;
+  int dfd, fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("stream", 0), "create \"stream\"");
+  CHECK ((dfd = open_direct ("stream")) > 1, "open_direct \"stream\"");
+  for (ofs = 0; ofs < sizeof buf; ofs += CHUNK)
+    {
+      size_t size = sizeof buf - ofs < CHUNK ? sizeof buf - ofs : CHUNK;
+      if (write (dfd, buf + ofs, size) != (int) size)
+        fail ("write %zu bytes at offset %zu in \"stream\" failed",
+              size, ofs);
+    }
+  msg ("write \"stream\" directly");
+
+  CHECK ((fd = open ("stream")) > 1, "open \"stream\"");
+  msg ("read \"stream\" through the cache");
+  read_and_compare (fd, "stream");
+
+  memset (buf + CHUNK, 'x', 2 * CHUNK);
+  seek (fd, CHUNK);
+  CHECK (write (fd, buf + CHUNK, 2 * CHUNK) == 2 * CHUNK,
+         "overwrite \"stream\" through the cache");
+  msg ("read \"stream\" directly");
+  read_and_compare (dfd, "stream");
+
+  memset (buf, 'y', CHUNK);
+  seek (dfd, 0);
+  CHECK (write (dfd, buf, CHUNK) == CHUNK, "overwrite \"stream\" directly");
+  msg ("read \"stream\" through the cache");
+  read_and_compare (fd, "stream");
+
+  msg ("close \"stream\"");
+  close (dfd);
+  msg ("close \"stream\"");
+  close (fd);
+  check_file ("stream", buf, sizeof buf);
+}
@@ -0,0 +1,23 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(direct-io) begin
+(direct-io) create "stream"
+(direct-io) open_direct "stream"
+(direct-io) write "stream" directly
+(direct-io) open "stream"
+(direct-io) read "stream" through the cache
+(direct-io) overwrite "stream" through the cache
+(direct-io) read "stream" directly
+(direct-io) overwrite "stream" directly
+(direct-io) read "stream" through the cache
+(direct-io) close "stream"
+(direct-io) close "stream"
+(direct-io) open "stream" for verification
+(direct-io) verified contents of "stream"
+(direct-io) close "stream"
+(direct-io) end
+EOF
+pass;
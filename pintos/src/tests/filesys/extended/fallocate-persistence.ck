@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($reserved) = random_bytes (70000);
+my ($gapped) = "\0" x 12000 . substr ($reserved, 0, 2000);
+check_archive ({"reserved" => [$reserved], "gapped" => [$gapped]});
+pass;
@@ -0,0 +1,58 @@
+/* Reserves space for a file large enough to need several extents'
+   worth of blocks, checks that reserving leaves its size alone and
+   that fallocate rejects a file descriptor that is not open, and
+   then fills the reserved space with many small writes.  Then
+   reserves space for a second file and writes past its end of file,
+   inside the reservation, and checks that the gap reads as zeros. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[70000];
+
+/* Expected contents of the second file: zeros up to GAP_END, then
+   the first DATA_SIZE bytes of BUF. */
+#define GAP_END 12000
+#define DATA_SIZE 2000
+static char gapped[GAP_END + DATA_SIZE];
+
+void
+test_main (void)
+{
+  size_t ofs;
+  int fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("reserved", 0), "create \"reserved\"");
+  CHECK ((fd = open ("reserved")) > 1, "open \"reserved\"");
+  CHECK (fallocate (fd, sizeof buf), "fallocate \"reserved\"");
+  CHECK (filesize (fd) == 0, "filesize \"reserved\" is still 0");
+  CHECK (!fallocate (fd + 1, sizeof buf), "fallocate unopened fd fails");
+  for (ofs = 0; ofs < sizeof buf; ofs += 700)
+    if (write (fd, buf + ofs, 700) != 700)
+      fail ("write %zu bytes at offset %zu in \"reserved\" failed",
+            (size_t) 700, ofs);
+  msg ("append to \"reserved\"");
+  CHECK (filesize (fd) == sizeof buf, "filesize \"reserved\" is %zu",
+         sizeof buf);
+  msg ("close \"reserved\"");
+  close (fd);
+  check_file ("reserved", buf, sizeof buf);
+
+  memcpy (gapped + GAP_END, buf, DATA_SIZE);
+  CHECK (create ("gapped", 0), "create \"gapped\"");
+  CHECK ((fd = open ("gapped")) > 1, "open \"gapped\"");
+  CHECK (fallocate (fd, 20000), "fallocate \"gapped\"");
+  msg ("seek \"gapped\" to %d", GAP_END);
+  seek (fd, GAP_END);
+  CHECK (write (fd, buf, DATA_SIZE) == DATA_SIZE,
+         "write %d bytes to \"gapped\"", DATA_SIZE);
+  CHECK (filesize (fd) == sizeof gapped, "filesize \"gapped\" is %zu",
+         sizeof gapped);
+  msg ("close \"gapped\"");
+  close (fd);
+  check_file ("gapped", gapped, sizeof gapped);
+}
@@ -0,0 +1,30 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fallocate) begin
+(fallocate) create "reserved"
+(fallocate) open "reserved"
+(fallocate) fallocate "reserved"
+(fallocate) filesize "reserved" is still 0
+(fallocate) fallocate unopened fd fails
+(fallocate) append to "reserved"
+(fallocate) filesize "reserved" is 70000
+(fallocate) close "reserved"
+(fallocate) open "reserved" for verification
+(fallocate) verified contents of "reserved"
+(fallocate) close "reserved"
+(fallocate) create "gapped"
+(fallocate) open "gapped"
+(fallocate) fallocate "gapped"
+(fallocate) seek "gapped" to 12000
+(fallocate) write 2000 bytes to "gapped"
+(fallocate) filesize "gapped" is 14000
+(fallocate) close "gapped"
+(fallocate) open "gapped" for verification
+(fallocate) verified contents of "gapped"
+(fallocate) close "gapped"
+(fallocate) end
+EOF
+pass;
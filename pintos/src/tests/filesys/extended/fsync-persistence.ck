@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($data) = random_bytes (70000);
+check_archive ({"synced" => [substr ($data, 0, 5000)],
+                "durable" => [$data]});
+pass;
@@ -0,0 +1,43 @@
+/* Writes a file and flushes everything with sync, then writes a
+   second file large enough to need an indirect block and forces
+   just that one to disk with fsync, and checks that fsync rejects
+   a file descriptor that is not open.  The kernel is run with
+   background write-back off and powers off without writing back
+   its cache, as if the power failed, so the persistence check
+   only passes if sync and fsync themselves made the data
+   durable. */
+
+#include <random.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SYNCED_SIZE 5000
+
+static char buf[70000];
+
+void
+test_main (void)
+{
+  int synced_fd, fd;
+
+  random_bytes (buf, sizeof buf);
+  CHECK (create ("synced", 0), "create \"synced\"");
+  CHECK ((synced_fd = open ("synced")) > 1, "open \"synced\"");
+  CHECK (write (synced_fd, buf, SYNCED_SIZE) == SYNCED_SIZE,
+         "write \"synced\"");
+  msg ("sync");
+  sync ();
+
+  CHECK (create ("durable", 0), "create \"durable\"");
+  CHECK ((fd = open ("durable")) > 1, "open \"durable\"");
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"durable\"");
+  CHECK (fsync (fd), "fsync \"durable\"");
+  CHECK (!fsync (fd + 1), "fsync unopened fd fails");
+  msg ("close \"synced\"");
+  close (synced_fd);
+  msg ("close \"durable\"");
+  close (fd);
+  check_file ("synced", buf, SYNCED_SIZE);
+  check_file ("durable", buf, sizeof buf);
+}
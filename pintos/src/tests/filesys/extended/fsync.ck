@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(fsync) begin
+(fsync) create "synced"
+(fsync) open "synced"
+(fsync) write "synced"
+(fsync) sync
+(fsync) create "durable"
+(fsync) open "durable"
+(fsync) write "durable"
+(fsync) fsync "durable"
+(fsync) fsync unopened fd fails
+(fsync) close "synced"
+(fsync) close "durable"
+(fsync) open "synced" for verification
+(fsync) verified contents of "synced"
+(fsync) close "synced"
+(fsync) open "durable" for verification
+(fsync) verified contents of "durable"
+(fsync) close "durable"
+(fsync) end
+EOF
+pass;
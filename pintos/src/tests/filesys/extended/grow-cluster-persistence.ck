@@ -0,0 +1,9 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+use tests::random;
+my ($data) = random_bytes (60000);
+substr ($data, 20000, 20000) = "\0" x 20000;
+check_archive ({"clustered" => [$data]});
+pass;
@@ -0,0 +1,53 @@
+/* Grows a file on a file system formatted with 8-sector blocks,
+   writing in pieces that straddle block boundaries and seeking past
+   the end of file partway through, and checks that the contents,
+   including the zeros in the gap, read back correctly. */
+
+#include <random.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE 60000
+#define GAP_START 20000
+#define GAP_END 40000
+#define CHUNK_SIZE 1234
+
+static char buf[FILE_SIZE];
+
+static void
+write_range (int fd, size_t start, size_t end)
+{
+  size_t ofs;
+
+  for (ofs = start; ofs < end; ofs += CHUNK_SIZE)
+    {
+      size_t size = end - ofs < CHUNK_SIZE ? end - ofs : CHUNK_SIZE;
+      if ((size_t) write (fd, buf + ofs, size) != size)
+        fail ("write %zu bytes at offset %zu in \"clustered\" failed",
+              size, ofs);
+    }
+}
+
+void
+test_main (void)
+{
+  int fd;
+
+  random_init (0);
+  random_bytes (buf, sizeof buf);
+  memset (buf + GAP_START, 0, GAP_END - GAP_START);
+
+  CHECK (create ("clustered", 0), "create \"clustered\"");
+  CHECK ((fd = open ("clustered")) > 1, "open \"clustered\"");
+  msg ("write \"clustered\" up to %d", GAP_START);
+  write_range (fd, 0, GAP_START);
+  msg ("seek \"clustered\" to %d", GAP_END);
+  seek (fd, GAP_END);
+  msg ("write \"clustered\" up to %d", FILE_SIZE);
+  write_range (fd, GAP_END, FILE_SIZE);
+  msg ("close \"clustered\"");
+  close (fd);
+  check_file ("clustered", buf, sizeof buf);
+}
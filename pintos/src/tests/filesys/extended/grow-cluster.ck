@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-cluster) begin
+(grow-cluster) create "clustered"
+(grow-cluster) open "clustered"
+(grow-cluster) write "clustered" up to 20000
+(grow-cluster) seek "clustered" to 40000
+(grow-cluster) write "clustered" up to 60000
+(grow-cluster) close "clustered"
+(grow-cluster) open "clustered" for verification
+(grow-cluster) verified contents of "clustered"
+(grow-cluster) close "clustered"
+(grow-cluster) end
+EOF
+pass;
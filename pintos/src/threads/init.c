@@ -34,6 +34,7 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "filesys/bufcache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
 #endif
@@ -247,6 +248,26 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-wb-interval"))
+        bufcache_flush_interval = atoi (value);
+      else if (!strcmp (name, "-wb-high"))
+        bufcache_dirty_high = atoi (value);
+      else if (!strcmp (name, "-wb-low"))
+        bufcache_dirty_low = atoi (value);
+      else if (!strcmp (name, "-cache-pct"))
+        bufcache_pct = atoi (value);
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (!bufcache_set_policy (value))
+            PANIC ("unknown cache policy `%s' (use -h for help)", value);
+        }
+      else if (!strcmp (name, "-no-shutdown-sync"))
+        filesys_sync_at_shutdown = false;
+      else if (!strcmp (name, "-cluster"))
+        {
+          if (!filesys_set_cluster (atoi (value)))
+            PANIC ("bad cluster size `%s' (use -h for help)", value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -373,6 +394,13 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -wb-interval=MS    Flush dirty cache blocks every MS ms (0: never).\n"
+          "  -wb-high=PCT       Start flushing early when PCT%% of cache is dirty.\n"
+          "  -wb-low=PCT        When flushing early, stop at PCT%% dirty.\n"
+          "  -cache-pct=PCT     Use up to PCT%% of kernel memory for the buffer cache.\n"
+          "  -cache-policy=POL  Buffer cache replacement: lru or 2q (default).\n"
+          "  -no-shutdown-sync  Power off without writing back the cache, as in a crash.\n"
+          "  -cluster=N         With -f, use blocks of N sectors: 1 (default), 2, 4 or 8.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -148,6 +148,31 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of pages in the pool that FLAGS would
+   allocate from: the user pool if PAL_USER is set, otherwise the
+   kernel pool. */
+size_t
+palloc_page_cnt (enum palloc_flags flags)
+{
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+  return bitmap_size (pool->used_map);
+}
+
+/* Returns the number of pages currently free in the pool that
+   FLAGS would allocate from. */
+size_t
+palloc_free_cnt (enum palloc_flags flags)
+{
+  struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+  size_t free_cnt;
+
+  lock_acquire (&pool->lock);
+  free_cnt = bitmap_count (pool->used_map, 0, bitmap_size (pool->used_map),
+                           false);
+  lock_release (&pool->lock);
+  return free_cnt;
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
@@ -122,6 +122,12 @@ struct thread
 
 #endif
 
+#ifdef FILESYS
+    /* Owned by filesys/journal.c. */
+    int journal_depth;                  /* Nesting of journal_begin(). */
+    int journal_cnt;                    /* Blocks its operation logged. */
+#endif
+
     /* Owned by thread.c. */
     unsigned magic;                     /* Detects stack overflow. */
   };
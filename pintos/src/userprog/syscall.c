@@ -29,6 +29,10 @@ int syscall_read (int fd, void *buffer, unsigned size);
 void syscall_seek (int fd, unsigned position);
 unsigned syscall_tell (int fd);
 void syscall_close (int fd);
+bool syscall_fsync (int fd);
+void syscall_sync (void);
+bool syscall_fallocate (int fd, unsigned size);
+int syscall_open_direct (const char *file);
 struct file* search_fd (struct list* list, int value);
 struct global_file* search_global(struct file* file);
 struct global_file* insert_global(struct file* file);
@@ -171,10 +175,10 @@ syscall_handler (struct intr_frame *f UNUSED)
   /* Validate pointer */
   validate_pointer(&args[0], f);
   int n = 1;
-  if (args[0] == SYS_HALT) {
+  if (args[0] == SYS_HALT || args[0] == SYS_SYNC) {
       n = 0;
   } else if (args[0] == SYS_CREATE || args[0] == SYS_SEEK || args[0] == SYS_MMAP
-         || args[0] == SYS_READDIR) {
+         || args[0] == SYS_READDIR || args[0] == SYS_FALLOCATE) {
       n = 2;
   } else if (args[0] == SYS_READ || args[0] == SYS_WRITE)  {
       n = 3;
@@ -270,6 +274,25 @@ syscall_handler (struct intr_frame *f UNUSED)
     }
     syscall_close(fd);
 
+  } else if (args[0] == SYS_FSYNC) {
+
+      f->eax = syscall_fsync(args[1]);
+
+  } else if (args[0] == SYS_SYNC) {
+
+      syscall_sync();
+
+  } else if (args[0] == SYS_FALLOCATE) {
+
+      f->eax = syscall_fallocate(args[1], args[2]);
+
+  } else if (args[0] == SYS_OPEN_DIRECT) {
+      validate_string((char*) args[1], f);
+
+      char *file = pagedir_get_page(thread_current()->pagedir, (void*) args[1]);
+
+      f->eax = syscall_open_direct(file);
+
   } else {
       system_exit(f, -1);
   }
@@ -427,3 +450,32 @@ void syscall_close (int fd) {
     delete_global(file);
     file_close(file);
   }
+
+bool syscall_fsync (int fd) {
+  struct file *file = search_fd(&thread_current()->fds, fd);
+  if (file == NULL) {
+    return false;
+  }
+  file_sync(file);
+  return true;
+}
+
+void syscall_sync (void) {
+  filesys_sync();
+}
+
+bool syscall_fallocate (int fd, unsigned size) {
+  struct file *file = search_fd(&thread_current()->fds, fd);
+  if (file == NULL || (off_t) size < 0) {
+    return false;
+  }
+  return file_allocate(file, size);
+}
+
+int syscall_open_direct (const char *file) {
+  int fd = syscall_open(file);
+  if (fd != -1) {
+    file_set_direct(search_fd(&thread_current()->fds, fd), true);
+  }
+  return fd;
+}